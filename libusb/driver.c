@@ -14,42 +14,98 @@
 #include <errno.h>
 #include <usbdriver.h>
 #include <sys/msg.h>
+#include <sys/minmax.h>
+#include <sys/threads.h>
+#include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
 
+#define USBDRV_EVENTS_PRIO    4
+#define USBDRV_EVENTS_STACKSZ 4096
+#define USBDRV_EVENTS_MAX     8
+#define USBDRV_TABLE_MIN      16
 
+/* Server lookup retry delays, us */
+#define USBDRV_LOOKUP_DELAY_MIN 1000
+#define USBDRV_LOOKUP_DELAY_MAX 50000
+
+
+typedef struct {
+	usb_ctx_t *ctx;
+	unsigned pipe;
+	int urbid;
+	usb_completionCb_t cb;
+	void *arg;
+} usbdrv_control_t;
+
+
+/* Used by the functions without a context argument */
 static struct {
-	unsigned port;
+	usb_ctx_t ctx;
+	usb_devinfo_t insertion;
 } usbdrv_common;
 
 
-int usb_connect(const usb_device_id_t *filters, int nfilters, unsigned drvport)
+void usb_ctxInit(usb_ctx_t *ctx)
+{
+	memset(ctx, 0, sizeof(*ctx));
+}
+
+
+static int usb_serverLookup(const char *path, time_t timeout, oid_t *oid)
+{
+	time_t delay = USBDRV_LOOKUP_DELAY_MIN, waited = 0;
+
+	/* There is no notification of the server registering, back off exponentially */
+	while (lookup(path, NULL, oid) < 0) {
+		if (timeout != 0) {
+			if (waited >= timeout)
+				return -ETIMEDOUT;
+			delay = min(delay, timeout - waited);
+		}
+
+		usleep(delay);
+		waited += delay;
+		delay = min(2 * delay, USBDRV_LOOKUP_DELAY_MAX);
+	}
+
+	return 0;
+}
+
+
+int usb_ctxConnect(usb_ctx_t *ctx, const char *path, const usb_device_id_t *filters, int nfilters, unsigned drvport, time_t timeout)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)&msg.i.raw;
 	oid_t oid;
+	int ret;
 
-	while (lookup("/dev/usb", NULL, &oid) < 0)
-		usleep(1000000);
+	if (path == NULL)
+		path = "/dev/usb";
+
+	if ((ret = usb_serverLookup(path, timeout, &oid)) < 0)
+		return ret;
 
 	msg.type = mtDevCtl;
 	msg.i.size = sizeof(*filters) * nfilters;
 	msg.i.data = (void *)filters;
 
 	umsg->type = usb_msg_connect;
+	umsg->version = USB_MSG_VERSION;
 	umsg->connect.port = drvport;
 	umsg->connect.nfilters = nfilters;
+	umsg->connect.flags = ctx->flags;
 
 	if (msgSend(oid.port, &msg) < 0)
 		return -1;
 
-	usbdrv_common.port = oid.port;
+	ctx->port = oid.port;
 
 	return oid.port;
 }
 
 
-int usb_eventsWait(int port, msg_t *msg)
+int usb_eventsWaitDev(int port, msg_t *msg, usb_devinfo_t *dev)
 {
 	msg_rid_t rid;
 	int err;
@@ -60,6 +116,12 @@ int usb_eventsWait(int port, msg_t *msg)
 			return -1;
 	} while (err == -EINTR);
 
+	/* Out-of-line payload is released on respond */
+	if (usb_msgInsertion(msg) != NULL) {
+		memcpy(dev, msg->i.data, sizeof(*dev));
+		msg->i.data = dev;
+	}
+
 	if (msgRespond(port, msg, rid) < 0)
 		return -1;
 
@@ -67,7 +129,229 @@ int usb_eventsWait(int port, msg_t *msg)
 }
 
 
-int usb_open(usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir)
+const usb_msg_t *usb_msgGet(const msg_t *msg)
+{
+	const usb_msg_t *umsg = (const usb_msg_t *)msg->i.raw;
+
+	if (umsg->version != USB_MSG_VERSION)
+		return NULL;
+
+	return umsg;
+}
+
+
+const usb_devinfo_t *usb_msgInsertion(const msg_t *msg)
+{
+	const usb_msg_t *umsg = usb_msgGet(msg);
+
+	if (umsg == NULL || umsg->type != usb_msg_insertion || msg->i.size != sizeof(usb_devinfo_t))
+		return NULL;
+
+	return msg->i.data;
+}
+
+
+static int _usb_tableSet(usb_cbtable_t *table, unsigned id, usb_completionCb_t cb, void *arg)
+{
+	usb_callback_t *cbs;
+	unsigned size;
+
+	if (id >= table->size) {
+		if (cb == NULL)
+			return 0;
+
+		for (size = max(table->size, USBDRV_TABLE_MIN); size <= id; size *= 2)
+			;
+
+		if ((cbs = realloc(table->cbs, size * sizeof(*cbs))) == NULL)
+			return -ENOMEM;
+
+		memset(cbs + table->size, 0, (size - table->size) * sizeof(*cbs));
+		table->cbs = cbs;
+		table->size = size;
+	}
+
+	table->cbs[id].cb = cb;
+	table->cbs[id].arg = arg;
+
+	return 0;
+}
+
+
+static int usb_tableSet(usb_ctx_t *ctx, usb_cbtable_t *table, unsigned id, usb_completionCb_t cb, void *arg)
+{
+	int ret;
+
+	if (!ctx->started)
+		return -EINVAL;
+
+	mutexLock(ctx->lock);
+	ret = _usb_tableSet(table, id, cb, arg);
+	mutexUnlock(ctx->lock);
+
+	return ret;
+}
+
+
+int usb_ctxUrbCallback(usb_ctx_t *ctx, unsigned urbid, usb_completionCb_t cb, void *arg)
+{
+	return usb_tableSet(ctx, &ctx->urbs, urbid, cb, arg);
+}
+
+
+int usb_ctxPipeCallback(usb_ctx_t *ctx, unsigned pipe, usb_completionCb_t cb, void *arg)
+{
+	return usb_tableSet(ctx, &ctx->pipes, pipe, cb, arg);
+}
+
+
+static void usb_eventsComplete(usb_ctx_t *ctx, const usb_completion_t *c, const void *data, size_t size)
+{
+	usb_callback_t cb = { NULL, NULL };
+
+	mutexLock(ctx->lock);
+	if (c->urbid >= 0 && c->urbid < ctx->urbs.size)
+		cb = ctx->urbs.cbs[c->urbid];
+	if (cb.cb == NULL && c->pipeid >= 0 && c->pipeid < ctx->pipes.size)
+		cb = ctx->pipes.cbs[c->pipeid];
+	mutexUnlock(ctx->lock);
+
+	if (cb.cb == NULL) {
+		cb.cb = ctx->handlers.completion;
+		cb.arg = ctx->handlers.arg;
+	}
+
+	if (cb.cb != NULL)
+		cb.cb(c, data, size, cb.arg);
+}
+
+
+static void usb_eventsDispatch(usb_ctx_t *ctx, msg_t *msg)
+{
+	const usb_handlers_t *h = &ctx->handlers;
+	const usb_msg_t *umsg;
+	const usb_devinfo_t *info;
+	const usb_completion_t *cs;
+	size_t i;
+
+	if (msg->type != mtDevCtl || (umsg = usb_msgGet(msg)) == NULL)
+		return;
+
+	switch (umsg->type) {
+		case usb_msg_insertion:
+			if (h->insertion != NULL && (info = usb_msgInsertion(msg)) != NULL)
+				h->insertion(info, h->arg);
+			break;
+
+		case usb_msg_deletion:
+			if (h->deletion != NULL)
+				h->deletion(&umsg->deletion, h->arg);
+			break;
+
+		case usb_msg_completion:
+			usb_eventsComplete(ctx, &umsg->completion, msg->i.data, msg->i.size);
+			break;
+
+		case usb_msg_completionv:
+			cs = msg->i.data;
+			for (i = 0; i < msg->i.size / sizeof(*cs); i++)
+				usb_eventsComplete(ctx, &cs[i], NULL, 0);
+			break;
+
+		default:
+			break;
+	}
+}
+
+
+static void usb_eventsThread(void *arg)
+{
+	usb_ctx_t *ctx = arg;
+	msg_rid_t rid;
+	msg_t msg;
+
+	for (;;) {
+		if (msgRecv(ctx->drvport, &msg, &rid) < 0)
+			continue;
+
+		/* Out-of-line data is valid until the server is responded to */
+		usb_eventsDispatch(ctx, &msg);
+		msgRespond(ctx->drvport, &msg, rid);
+
+		if (ctx->stop)
+			break;
+	}
+
+	endthread();
+}
+
+
+/* Stops n event threads of an unconnected context, each wakeup is received by exactly one of them */
+static void usb_eventsStop(usb_ctx_t *ctx, handle_t *tids, void **stacks, int n)
+{
+	msg_t msg;
+	int i;
+
+	ctx->stop = 1;
+
+	for (i = 0; i < n; i++) {
+		memset(&msg, 0, sizeof(msg));
+		msg.type = mtDevCtl;
+		msgSend(ctx->drvport, &msg);
+	}
+
+	for (i = 0; i < n; i++) {
+		threadJoin(tids[i], 0);
+		free(stacks[i]);
+	}
+
+	ctx->stop = 0;
+}
+
+
+int usb_ctxEventsStart(usb_ctx_t *ctx, unsigned drvport, const usb_handlers_t *handlers, int nthreads)
+{
+	void *stacks[USBDRV_EVENTS_MAX];
+	handle_t tids[USBDRV_EVENTS_MAX];
+	int i;
+
+	if (ctx->started || nthreads <= 0 || nthreads > USBDRV_EVENTS_MAX)
+		return -EINVAL;
+
+	if (mutexCreate(&ctx->lock) != 0)
+		return -ENOMEM;
+
+	ctx->drvport = drvport;
+	ctx->handlers = *handlers;
+	ctx->stop = 0;
+
+	for (i = 0; i < nthreads; i++) {
+		if ((stacks[i] = malloc(USBDRV_EVENTS_STACKSZ)) == NULL)
+			break;
+
+		if (beginthreadex(usb_eventsThread, USBDRV_EVENTS_PRIO, stacks[i], USBDRV_EVENTS_STACKSZ, ctx, &tids[i]) < 0) {
+			free(stacks[i]);
+			break;
+		}
+	}
+
+	/* A partial start is a failure, the caller may retry with fewer threads */
+	if (i < nthreads) {
+		usb_eventsStop(ctx, tids, stacks, i);
+		resourceDestroy(ctx->lock);
+		return -ENOMEM;
+	}
+
+	ctx->started = 1;
+
+	/* Completions of URBs without IN data may now be coalesced by the server */
+	ctx->flags |= USB_CONNECT_BATCH;
+
+	return 0;
+}
+
+
+int usb_ctxOpen(usb_ctx_t *ctx, usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
@@ -75,6 +359,7 @@ int usb_open(usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir)
 
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_open;
+	umsg->version = USB_MSG_VERSION;
 
 	umsg->open.bus = dev->bus;
 	umsg->open.dev = dev->dev;
@@ -83,14 +368,14 @@ int usb_open(usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir)
 	umsg->open.dir = dir;
 	umsg->open.locationID = dev->locationID;
 
-	if ((ret = msgSend(usbdrv_common.port, &msg)) != 0)
+	if ((ret = msgSend(ctx->port, &msg)) != 0)
 		return ret;
 
 	return msg.o.err;
 }
 
 
-static int usb_urbSubmitSync(usb_urb_t *urb, void *data)
+static int usb_urbSubmitSync(usb_ctx_t *ctx, usb_urb_t *urb, void *data)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
@@ -98,6 +383,7 @@ static int usb_urbSubmitSync(usb_urb_t *urb, void *data)
 
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_urb;
+	umsg->version = USB_MSG_VERSION;
 
 	memcpy(&umsg->urb, urb, sizeof(usb_urb_t));
 
@@ -110,14 +396,24 @@ static int usb_urbSubmitSync(usb_urb_t *urb, void *data)
 		msg.o.size = urb->size;
 	}
 
-	if ((ret = msgSend(usbdrv_common.port, &msg)) != 0)
+	if ((ret = msgSend(ctx->port, &msg)) != 0)
 		return ret;
 
 	return msg.o.err;
 }
 
 
-int usb_transferControl(unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir)
+/* Server timeouts have ms resolution, rounded up so that a short timeout does not become none */
+static uint32_t usb_timeoutMs(time_t timeout)
+{
+	if (timeout <= 0)
+		return 0;
+
+	return (timeout >= (time_t)UINT32_MAX * 1000) ? UINT32_MAX : (uint32_t)((timeout + 999) / 1000);
+}
+
+
+int usb_ctxTransferControlTimeout(usb_ctx_t *ctx, unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir, time_t timeout)
 {
 	usb_urb_t urb = {
 		.pipe = pipe,
@@ -125,28 +421,42 @@ int usb_transferControl(unsigned pipe, usb_setup_packet_t *setup, void *data, si
 		.dir = dir,
 		.size = size,
 		.type = usb_transfer_control,
-		.sync = 1
+		.sync = 1,
+		.timeout = usb_timeoutMs(timeout)
 	};
 
-	return usb_urbSubmitSync(&urb, data);
+	return usb_urbSubmitSync(ctx, &urb, data);
 }
 
 
-int usb_transferBulk(unsigned pipe, void *data, size_t size, usb_dir_t dir)
+int usb_ctxTransferBulkTimeout(usb_ctx_t *ctx, unsigned pipe, void *data, size_t size, usb_dir_t dir, time_t timeout)
 {
 	usb_urb_t urb = {
 		.pipe = pipe,
 		.dir = dir,
 		.size = size,
 		.type = usb_transfer_bulk,
-		.sync = 1
+		.sync = 1,
+		.timeout = usb_timeoutMs(timeout)
 	};
 
-	return usb_urbSubmitSync(&urb, data);
+	return usb_urbSubmitSync(ctx, &urb, data);
 }
 
 
-int usb_setConfiguration(unsigned pipe, int conf)
+int usb_ctxTransferControl(usb_ctx_t *ctx, unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir)
+{
+	return usb_ctxTransferControlTimeout(ctx, pipe, setup, data, size, dir, 0);
+}
+
+
+int usb_ctxTransferBulk(usb_ctx_t *ctx, unsigned pipe, void *data, size_t size, usb_dir_t dir)
+{
+	return usb_ctxTransferBulkTimeout(ctx, pipe, data, size, dir, 0);
+}
+
+
+int usb_ctxSetConfiguration(usb_ctx_t *ctx, unsigned pipe, int conf)
 {
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
 		.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
@@ -156,11 +466,11 @@ int usb_setConfiguration(unsigned pipe, int conf)
 		.wLength = 0,
 	};
 
-	return usb_transferControl(pipe, &setup, NULL, 0, usb_dir_out);
+	return usb_ctxTransferControl(ctx, pipe, &setup, NULL, 0, usb_dir_out);
 }
 
 
-int usb_clearFeatureHalt(unsigned pipe, int ep)
+int usb_ctxClearFeatureHalt(usb_ctx_t *ctx, unsigned pipe, int ep)
 {
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
 		.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_DEVICE,
@@ -170,11 +480,32 @@ int usb_clearFeatureHalt(unsigned pipe, int ep)
 		.wLength = 0,
 	};
 
-	return usb_transferControl(pipe, &setup, NULL, 0, usb_dir_out);
+	return usb_ctxTransferControl(ctx, pipe, &setup, NULL, 0, usb_dir_out);
 }
 
 
-int usb_urbAlloc(unsigned pipe, void *data, usb_dir_t dir, size_t size, int type)
+int usb_ctxAutosuspend(usb_ctx_t *ctx, usb_devinfo_t *dev, int enable)
+{
+	msg_t msg = { 0 };
+	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
+	int ret;
+
+	msg.type = mtDevCtl;
+	umsg->type = usb_msg_autosuspend;
+	umsg->version = USB_MSG_VERSION;
+
+	umsg->autosuspend.locationID = dev->locationID;
+	umsg->autosuspend.iface = dev->interface;
+	umsg->autosuspend.enable = enable;
+
+	if ((ret = msgSend(ctx->port, &msg)) != 0)
+		return ret;
+
+	return msg.o.err;
+}
+
+
+int usb_ctxUrbAlloc(usb_ctx_t *ctx, unsigned pipe, void *data, usb_dir_t dir, size_t size, int type)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
@@ -187,10 +518,17 @@ int usb_urbAlloc(unsigned pipe, void *data, usb_dir_t dir, size_t size, int type
 	urb->size = size;
 	urb->sync = 0;
 
+	/* Initial OUT data */
+	if (dir == usb_dir_out && data != NULL) {
+		msg.i.data = data;
+		msg.i.size = size;
+	}
+
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_urb;
+	umsg->version = USB_MSG_VERSION;
 
-	if ((ret = msgSend(usbdrv_common.port, &msg)) < 0)
+	if ((ret = msgSend(ctx->port, &msg)) < 0)
 		return ret;
 
 	/* URB id */
@@ -198,7 +536,7 @@ int usb_urbAlloc(unsigned pipe, void *data, usb_dir_t dir, size_t size, int type
 }
 
 
-int usb_transferAsync(unsigned pipe, unsigned urbid, size_t size, usb_setup_packet_t *setup)
+int usb_ctxTransferAsync(usb_ctx_t *ctx, unsigned pipe, unsigned urbid, size_t size, usb_setup_packet_t *setup)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
@@ -215,14 +553,34 @@ int usb_transferAsync(unsigned pipe, unsigned urbid, size_t size, usb_setup_pack
 	}
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_urbcmd;
-	if ((ret = msgSend(usbdrv_common.port, &msg)) < 0)
+	umsg->version = USB_MSG_VERSION;
+	if ((ret = msgSend(ctx->port, &msg)) < 0)
 		return ret;
 
 	return 0;
 }
 
 
-int usb_urbFree(unsigned pipe, unsigned urb)
+int usb_ctxTransferAsyncv(usb_ctx_t *ctx, const usb_urbcmd_t *cmds, int n)
+{
+	msg_t msg = { 0 };
+	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
+	int ret;
+
+	umsg->urbcmd.cmd = urbcmd_submitv;
+	msg.i.data = cmds;
+	msg.i.size = n * sizeof(*cmds);
+	msg.type = mtDevCtl;
+	umsg->type = usb_msg_urbcmd;
+	umsg->version = USB_MSG_VERSION;
+	if ((ret = msgSend(ctx->port, &msg)) < 0)
+		return ret;
+
+	return msg.o.err;
+}
+
+
+int usb_ctxUrbFree(usb_ctx_t *ctx, unsigned pipe, unsigned urb)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
@@ -233,15 +591,99 @@ int usb_urbFree(unsigned pipe, unsigned urb)
 	urbcmd->urbid = urb;
 	urbcmd->cmd = urbcmd_free;
 
+	/* Cleared first, the server may hand the id to another URB as soon as it is freed */
+	if (ctx->started)
+		usb_ctxUrbCallback(ctx, urb, NULL, NULL);
+
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_urbcmd;
-	if ((ret = msgSend(usbdrv_common.port, &msg)) < 0)
+	umsg->version = USB_MSG_VERSION;
+	if ((ret = msgSend(ctx->port, &msg)) < 0)
 		return ret;
 
 	return 0;
 }
 
 
+static int usb_urbcmdSend(usb_ctx_t *ctx, unsigned pipe, unsigned urb, int cmd)
+{
+	msg_t msg = { 0 };
+	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
+	int ret;
+
+	umsg->urbcmd.pipeid = pipe;
+	umsg->urbcmd.urbid = urb;
+	umsg->urbcmd.cmd = cmd;
+
+	msg.type = mtDevCtl;
+	umsg->type = usb_msg_urbcmd;
+	umsg->version = USB_MSG_VERSION;
+	if ((ret = msgSend(ctx->port, &msg)) < 0)
+		return ret;
+
+	return msg.o.err;
+}
+
+
+int usb_ctxUrbCancel(usb_ctx_t *ctx, unsigned pipe, unsigned urb)
+{
+	return usb_urbcmdSend(ctx, pipe, urb, urbcmd_cancel);
+}
+
+
+int usb_ctxPipeCancelAll(usb_ctx_t *ctx, unsigned pipe)
+{
+	return usb_urbcmdSend(ctx, pipe, 0, urbcmd_cancelAll);
+}
+
+
+static void usb_controlCompleted(const usb_completion_t *c, const void *data, size_t size, void *arg)
+{
+	usbdrv_control_t *ctl = arg;
+
+	ctl->cb(c, data, size, ctl->arg);
+
+	usb_ctxUrbFree(ctl->ctx, ctl->pipe, ctl->urbid);
+	free(ctl);
+}
+
+
+int usb_ctxControlAsync(usb_ctx_t *ctx, unsigned pipe, const usb_setup_packet_t *setup, void *data, usb_completionCb_t cb, void *arg)
+{
+	usb_setup_packet_t tmp = *setup;
+	usbdrv_control_t *ctl;
+	usb_dir_t dir;
+	int ret;
+
+	if (!ctx->started || cb == NULL)
+		return -EINVAL;
+
+	if ((ctl = malloc(sizeof(*ctl))) == NULL)
+		return -ENOMEM;
+
+	dir = ((setup->bmRequestType & REQUEST_DIR_MASK) == REQUEST_DIR_DEV2HOST) ? usb_dir_in : usb_dir_out;
+	if ((ret = usb_ctxUrbAlloc(ctx, pipe, data, dir, setup->wLength, usb_transfer_control)) < 0) {
+		free(ctl);
+		return ret;
+	}
+
+	ctl->ctx = ctx;
+	ctl->pipe = pipe;
+	ctl->urbid = ret;
+	ctl->cb = cb;
+	ctl->arg = arg;
+
+	if ((ret = usb_ctxUrbCallback(ctx, ctl->urbid, usb_controlCompleted, ctl)) < 0 ||
+			(ret = usb_ctxTransferAsync(ctx, pipe, ctl->urbid, setup->wLength, &tmp)) < 0) {
+		usb_ctxUrbFree(ctx, pipe, ctl->urbid);
+		free(ctl);
+		return ret;
+	}
+
+	return ctl->urbid;
+}
+
+
 const usb_modeswitch_t *usb_modeswitchFind(uint16_t vid, uint16_t pid, const usb_modeswitch_t *modes, int nmodes)
 {
 	int i;
@@ -324,26 +766,152 @@ void usb_dumpStringDesc(FILE *stream, usb_string_desc_t *descr)
 }
 
 
-int usb_modeswitchHandle(usb_devinfo_t *dev, const usb_modeswitch_t *mode)
+int usb_ctxModeswitchHandle(usb_ctx_t *ctx, usb_devinfo_t *dev, const usb_modeswitch_t *mode)
 {
 	char msg[sizeof(mode->msg)];
 	int pipeCtrl, pipeIn, pipeOut;
 
-	if ((pipeCtrl = usb_open(dev, usb_transfer_control, 0)) < 0)
+	if ((pipeCtrl = usb_ctxOpen(ctx, dev, usb_transfer_control, 0)) < 0)
 		return -EINVAL;
 
-	if (usb_setConfiguration(pipeCtrl, 1) != 0)
+	if (usb_ctxSetConfiguration(ctx, pipeCtrl, 1) != 0)
 		return -EINVAL;
 
-	if ((pipeIn = usb_open(dev, usb_transfer_bulk, usb_dir_in)) < 0)
+	if ((pipeIn = usb_ctxOpen(ctx, dev, usb_transfer_bulk, usb_dir_in)) < 0)
 		return -EINVAL;
 
-	if ((pipeOut = usb_open(dev, usb_transfer_bulk, usb_dir_out)) < 0)
+	if ((pipeOut = usb_ctxOpen(ctx, dev, usb_transfer_bulk, usb_dir_out)) < 0)
 		return -EINVAL;
 
 	memcpy(msg, mode->msg, sizeof(msg));
-	if (usb_transferBulk(pipeOut, msg, sizeof(msg), usb_dir_out) < 0)
+	if (usb_ctxTransferBulk(ctx, pipeOut, msg, sizeof(msg), usb_dir_out) < 0)
 		return -EINVAL;
 
 	return 0;
 }
+
+
+int usb_connect(const usb_device_id_t *filters, int nfilters, unsigned drvport)
+{
+	return usb_ctxConnect(&usbdrv_common.ctx, NULL, filters, nfilters, drvport, 0);
+}
+
+
+int usb_eventsWait(int port, msg_t *msg)
+{
+	return usb_eventsWaitDev(port, msg, &usbdrv_common.insertion);
+}
+
+
+int usb_eventsStart(unsigned drvport, const usb_handlers_t *handlers, int nthreads)
+{
+	return usb_ctxEventsStart(&usbdrv_common.ctx, drvport, handlers, nthreads);
+}
+
+
+int usb_urbCallback(unsigned urbid, usb_completionCb_t cb, void *arg)
+{
+	return usb_ctxUrbCallback(&usbdrv_common.ctx, urbid, cb, arg);
+}
+
+
+int usb_pipeCallback(unsigned pipe, usb_completionCb_t cb, void *arg)
+{
+	return usb_ctxPipeCallback(&usbdrv_common.ctx, pipe, cb, arg);
+}
+
+
+int usb_open(usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir)
+{
+	return usb_ctxOpen(&usbdrv_common.ctx, dev, type, dir);
+}
+
+
+int usb_transferControl(unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir)
+{
+	return usb_ctxTransferControl(&usbdrv_common.ctx, pipe, setup, data, size, dir);
+}
+
+
+int usb_transferBulk(unsigned pipe, void *data, size_t size, usb_dir_t dir)
+{
+	return usb_ctxTransferBulk(&usbdrv_common.ctx, pipe, data, size, dir);
+}
+
+
+int usb_transferAsync(unsigned pipe, unsigned urbid, size_t size, usb_setup_packet_t *setup)
+{
+	return usb_ctxTransferAsync(&usbdrv_common.ctx, pipe, urbid, size, setup);
+}
+
+
+int usb_transferAsyncv(const usb_urbcmd_t *cmds, int n)
+{
+	return usb_ctxTransferAsyncv(&usbdrv_common.ctx, cmds, n);
+}
+
+
+int usb_setConfiguration(unsigned pipe, int conf)
+{
+	return usb_ctxSetConfiguration(&usbdrv_common.ctx, pipe, conf);
+}
+
+
+int usb_urbAlloc(unsigned pipe, void *data, usb_dir_t dir, size_t size, int type)
+{
+	return usb_ctxUrbAlloc(&usbdrv_common.ctx, pipe, data, dir, size, type);
+}
+
+
+int usb_urbFree(unsigned pipe, unsigned urb)
+{
+	return usb_ctxUrbFree(&usbdrv_common.ctx, pipe, urb);
+}
+
+
+int usb_clearFeatureHalt(unsigned pipe, int ep)
+{
+	return usb_ctxClearFeatureHalt(&usbdrv_common.ctx, pipe, ep);
+}
+
+
+int usb_autosuspend(usb_devinfo_t *dev, int enable)
+{
+	return usb_ctxAutosuspend(&usbdrv_common.ctx, dev, enable);
+}
+
+
+int usb_modeswitchHandle(usb_devinfo_t *dev, const usb_modeswitch_t *mode)
+{
+	return usb_ctxModeswitchHandle(&usbdrv_common.ctx, dev, mode);
+}
+
+
+int usb_urbCancel(unsigned pipe, unsigned urb)
+{
+	return usb_ctxUrbCancel(&usbdrv_common.ctx, pipe, urb);
+}
+
+
+int usb_pipeCancelAll(unsigned pipe)
+{
+	return usb_ctxPipeCancelAll(&usbdrv_common.ctx, pipe);
+}
+
+
+int usb_controlAsync(unsigned pipe, const usb_setup_packet_t *setup, void *data, usb_completionCb_t cb, void *arg)
+{
+	return usb_ctxControlAsync(&usbdrv_common.ctx, pipe, setup, data, cb, arg);
+}
+
+
+int usb_transferControlTimeout(unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir, time_t timeout)
+{
+	return usb_ctxTransferControlTimeout(&usbdrv_common.ctx, pipe, setup, data, size, dir, timeout);
+}
+
+
+int usb_transferBulkTimeout(unsigned pipe, void *data, size_t size, usb_dir_t dir, time_t timeout)
+{
+	return usb_ctxTransferBulkTimeout(&usbdrv_common.ctx, pipe, data, size, dir, timeout);
+}
@@ -24,6 +24,18 @@
 
 #define USBDRV_ANY ((unsigned)-1)
 
+/* Bumped on every incompatible change of usb_msg_t and the payloads it refers to */
+#define USB_MSG_VERSION 1
+
+/* usb_connect_t flags */
+#define USB_CONNECT_BATCH 0x1 /* Driver accepts usb_msg_completionv */
+
+/* locationID holds the bus number in the lowest byte followed by one byte per tier with the port number */
+#define USB_LOCATION_BITS     8
+#define USB_LOCATION_MASK     0xff
+#define USB_LOCATION_MAX_TIER 7
+#define USB_LOCATION_BUS(id)  ((unsigned)((id) & USB_LOCATION_MASK))
+
 
 enum {
 	usbdrv_nomatch = 0x0,
@@ -48,6 +60,7 @@ typedef struct {
 typedef struct {
 	unsigned port;
 	unsigned nfilters;
+	unsigned flags;
 } usb_connect_t;
 
 
@@ -58,6 +71,7 @@ typedef struct {
 	usb_dir_t dir;
 	int type;
 	int sync;
+	uint32_t timeout; /* Sync transfers, ms, 0 - none */
 } usb_urb_t;
 
 
@@ -65,7 +79,7 @@ typedef struct {
 	int bus;
 	int dev;
 	int iface;
-	unsigned locationID;
+	uint64_t locationID;
 	usb_transfer_type_t type;
 	usb_dir_t dir;
 } usb_open_t;
@@ -79,7 +93,7 @@ typedef struct {
 	int bus;
 	int dev;
 	int interface;
-	unsigned locationID;
+	uint64_t locationID;
 } usb_devinfo_t;
 
 
@@ -90,43 +104,64 @@ typedef struct {
 } usb_deletion_t;
 
 
+enum { urbcmd_submit,
+	urbcmd_cancel,
+	urbcmd_free,
+	urbcmd_submitv,
+	urbcmd_cancelAll };
+
+
 typedef struct {
-	int pipeid;
-	int urbid;
-	size_t size;
+	int32_t pipeid;
+	int32_t urbid;
+	uint32_t size;
 	usb_setup_packet_t setup;
-	enum {
-		urbcmd_submit,
-		urbcmd_cancel,
-		urbcmd_free } cmd;
+	uint8_t cmd;
 } usb_urbcmd_t;
 
 
 typedef struct {
-	int pipeid;
-	int urbid;
-	size_t transferred;
-	int err;
+	int32_t pipeid;
+	int32_t urbid;
+	uint32_t transferred;
+	int32_t err;
 } usb_completion_t;
 
 
 typedef struct {
-	enum { usb_msg_connect,
-		usb_msg_insertion,
-		usb_msg_deletion,
-		usb_msg_urb,
-		usb_msg_open,
-		usb_msg_urbcmd,
-		usb_msg_completion } type;
+	uint64_t locationID;
+	int iface;
+	int enable;
+} usb_autosuspend_t;
+
 
+enum { usb_msg_connect,
+	usb_msg_insertion,
+	usb_msg_deletion,
+	usb_msg_urb,
+	usb_msg_open,
+	usb_msg_urbcmd,
+	usb_msg_completion,
+	usb_msg_autosuspend,
+	usb_msg_completionv };
+
+
+/*
+ * Carried in msg_t i.raw and parsed in place. Only small fixed size payloads are kept
+ * inline, usb_msg_insertion carries usb_devinfo_t out-of-line in msg_t i.data.
+ * usb_msg_completionv carries an array of usb_completion_t of transfers without IN data.
+ */
+typedef struct {
+	uint8_t type;
+	uint8_t version;
 	union {
 		usb_connect_t connect;
 		usb_urb_t urb;
 		usb_urbcmd_t urbcmd;
 		usb_open_t open;
-		usb_devinfo_t insertion;
 		usb_deletion_t deletion;
 		usb_completion_t completion;
+		usb_autosuspend_t autosuspend;
 	};
 } usb_msg_t;
 
@@ -139,6 +174,46 @@ typedef struct {
 } usb_modeswitch_t;
 
 
+/* IN data of the completion is valid only for the duration of the callback */
+typedef void (*usb_completionCb_t)(const usb_completion_t *c, const void *data, size_t size, void *arg);
+
+
+typedef struct {
+	void (*insertion)(const usb_devinfo_t *dev, void *arg);
+	void (*deletion)(const usb_deletion_t *del, void *arg);
+	usb_completionCb_t completion; /* URBs without an URB or pipe callback */
+	void *arg;
+} usb_handlers_t;
+
+
+typedef struct {
+	usb_completionCb_t cb;
+	void *arg;
+} usb_callback_t;
+
+
+typedef struct {
+	usb_callback_t *cbs;
+	unsigned size;
+} usb_cbtable_t;
+
+
+/* Connection to a usb server, functions without a context argument use a default one */
+typedef struct {
+	unsigned port;
+	unsigned flags; /* usb_connect_t flags */
+
+	/* Event loop */
+	handle_t lock;
+	int started;
+	volatile int stop;
+	unsigned drvport;
+	usb_handlers_t handlers;
+	usb_cbtable_t urbs; /* Indexed by URB id */
+	usb_cbtable_t pipes; /* Indexed by pipe id */
+} usb_ctx_t;
+
+
 int usb_modeswitchHandle(usb_devinfo_t *dev, const usb_modeswitch_t *mode);
 
 
@@ -148,7 +223,41 @@ const usb_modeswitch_t *usb_modeswitchFind(uint16_t vid, uint16_t pid, const usb
 int usb_connect(const usb_device_id_t *filters, int nfilters, unsigned drvport);
 
 
-int usb_eventsWait(int port, msg_t *msg);
+/*
+ * Deprecated, use usb_eventsWaitDev(). Insertion device info of the received msg is kept in
+ * storage shared by all callers and stays valid only until the next call from any thread.
+ */
+int usb_eventsWait(int port, msg_t *msg) __attribute__((deprecated("use usb_eventsWaitDev()")));
+
+
+/* Receives and responds to the next event, insertion device info is copied to the caller's dev */
+int usb_eventsWaitDev(int port, msg_t *msg, usb_devinfo_t *dev);
+
+
+/* Returns the message header of msg received by usb_eventsWaitDev() or NULL on version mismatch */
+const usb_msg_t *usb_msgGet(const msg_t *msg);
+
+
+/* Returns the device info of a usb_msg_insertion message or NULL if msg carries none */
+const usb_devinfo_t *usb_msgInsertion(const msg_t *msg);
+
+
+/*
+ * Starts nthreads threads dispatching events received on drvport to handlers and callbacks,
+ * has to be called before usb_connect(). Callbacks run before the server is responded to,
+ * the controller's status thread waits meanwhile, so handlers and callbacks must not make
+ * synchronous calls (e.g. usb_transferBulk()) to the same controller, use the async ones instead.
+ * Fails without leaving threads running unless all of them are started.
+ */
+int usb_eventsStart(unsigned drvport, const usb_handlers_t *handlers, int nthreads);
+
+
+/* Sets the completion callback of an URB, cb == NULL removes it */
+int usb_urbCallback(unsigned urbid, usb_completionCb_t cb, void *arg);
+
+
+/* Sets the completion callback of URBs of the pipe without their own callback */
+int usb_pipeCallback(unsigned pipe, usb_completionCb_t cb, void *arg);
 
 
 int usb_open(usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir);
@@ -160,9 +269,23 @@ int usb_transferControl(unsigned pipe, usb_setup_packet_t *setup, void *data, si
 int usb_transferBulk(unsigned pipe, void *data, size_t size, usb_dir_t dir);
 
 
+/*
+ * Variants of usb_transferControl() and usb_transferBulk() waiting up to timeout us (0 - infinitely).
+ * On expiry the transfer is cancelled by the server, -ETIMEDOUT is returned and the pipe may be reused.
+ */
+int usb_transferControlTimeout(unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir, time_t timeout);
+
+
+int usb_transferBulkTimeout(unsigned pipe, void *data, size_t size, usb_dir_t dir, time_t timeout);
+
+
 int usb_transferAsync(unsigned pipe, unsigned urbid, size_t size, usb_setup_packet_t *setup);
 
 
+/* Submits n urbcmd_submit commands in one message, returns n or an error with none of them submitted */
+int usb_transferAsyncv(const usb_urbcmd_t *cmds, int n);
+
+
 int usb_setConfiguration(unsigned pipe, int conf);
 
 
@@ -175,6 +298,94 @@ int usb_urbFree(unsigned pipe, unsigned urb);
 int usb_clearFeatureHalt(unsigned pipe, int ep);
 
 
+/* Cancels a submitted URB, it completes with an error */
+int usb_urbCancel(unsigned pipe, unsigned urb);
+
+
+/* Cancels all submitted URBs of the pipe */
+int usb_pipeCancelAll(unsigned pipe);
+
+
+/*
+ * Issues a control transfer of setup->wLength bytes on a temporary URB and calls cb on completion,
+ * data is sent for OUT requests. Requires the event loop, returns the URB id valid until cb returns.
+ */
+int usb_controlAsync(unsigned pipe, const usb_setup_packet_t *setup, void *data, usb_completionCb_t cb, void *arg);
+
+
+/* Allows or forbids suspending the device while the interface is idle, allowed by default */
+int usb_autosuspend(usb_devinfo_t *dev, int enable);
+
+
+void usb_ctxInit(usb_ctx_t *ctx);
+
+
+/*
+ * Connects to the usb server registered at path, "/dev/usb" if NULL. Waits up to timeout us
+ * (0 - infinitely) for the server to appear, returns -ETIMEDOUT if it does not.
+ */
+int usb_ctxConnect(usb_ctx_t *ctx, const char *path, const usb_device_id_t *filters, int nfilters, unsigned drvport, time_t timeout);
+
+
+int usb_ctxEventsStart(usb_ctx_t *ctx, unsigned drvport, const usb_handlers_t *handlers, int nthreads);
+
+
+int usb_ctxUrbCallback(usb_ctx_t *ctx, unsigned urbid, usb_completionCb_t cb, void *arg);
+
+
+int usb_ctxPipeCallback(usb_ctx_t *ctx, unsigned pipe, usb_completionCb_t cb, void *arg);
+
+
+int usb_ctxOpen(usb_ctx_t *ctx, usb_devinfo_t *dev, usb_transfer_type_t type, usb_dir_t dir);
+
+
+int usb_ctxTransferControl(usb_ctx_t *ctx, unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir);
+
+
+int usb_ctxTransferBulk(usb_ctx_t *ctx, unsigned pipe, void *data, size_t size, usb_dir_t dir);
+
+
+int usb_ctxTransferControlTimeout(usb_ctx_t *ctx, unsigned pipe, usb_setup_packet_t *setup, void *data, size_t size, usb_dir_t dir, time_t timeout);
+
+
+int usb_ctxTransferBulkTimeout(usb_ctx_t *ctx, unsigned pipe, void *data, size_t size, usb_dir_t dir, time_t timeout);
+
+
+int usb_ctxTransferAsync(usb_ctx_t *ctx, unsigned pipe, unsigned urbid, size_t size, usb_setup_packet_t *setup);
+
+
+/* Submits n URBs at once, all entries must be urbcmd_submit. Returns n, or an error if
+ * any of them is rejected, then none of them is submitted */
+int usb_ctxTransferAsyncv(usb_ctx_t *ctx, const usb_urbcmd_t *cmds, int n);
+
+
+int usb_ctxSetConfiguration(usb_ctx_t *ctx, unsigned pipe, int conf);
+
+
+int usb_ctxUrbAlloc(usb_ctx_t *ctx, unsigned pipe, void *data, usb_dir_t dir, size_t size, int type);
+
+
+int usb_ctxUrbFree(usb_ctx_t *ctx, unsigned pipe, unsigned urb);
+
+
+int usb_ctxClearFeatureHalt(usb_ctx_t *ctx, unsigned pipe, int ep);
+
+
+int usb_ctxUrbCancel(usb_ctx_t *ctx, unsigned pipe, unsigned urb);
+
+
+int usb_ctxPipeCancelAll(usb_ctx_t *ctx, unsigned pipe);
+
+
+int usb_ctxControlAsync(usb_ctx_t *ctx, unsigned pipe, const usb_setup_packet_t *setup, void *data, usb_completionCb_t cb, void *arg);
+
+
+int usb_ctxAutosuspend(usb_ctx_t *ctx, usb_devinfo_t *dev, int enable);
+
+
+int usb_ctxModeswitchHandle(usb_ctx_t *ctx, usb_devinfo_t *dev, const usb_modeswitch_t *mode);
+
+
 void usb_dumpDeviceDescriptor(FILE *stream, usb_device_desc_t *descr);
 
 
@@ -28,13 +28,16 @@
 #include "hcd.h"
 #include "hub.h"
 
-#define USBDEV_BUF_SIZE 0x200
+#define USBDEV_BUF_SIZE   0x200
+#define USBDEV_SETUP_SIZE 32
+#define USBDEV_HASH_SIZE  256
 
 struct {
 	handle_t lock;
 	handle_t cond;
-	char *ctrlBuf;
-	char *setupBuf;
+	handle_t hashLock;
+	handle_t pmLock;
+	usb_dev_t *hash[USBDEV_HASH_SIZE];
 } usbdev_common;
 
 
@@ -43,8 +46,8 @@ int usb_devCtrl(usb_dev_t *dev, usb_dir_t dir, usb_setup_packet_t *setup, char *
 	usb_transfer_t t = (usb_transfer_t) {
 		.type = usb_transfer_control,
 		.direction = dir,
-		.setup = (usb_setup_packet_t *)usbdev_common.setupBuf,
-		.buffer = usbdev_common.ctrlBuf,
+		.setup = dev->setupBuf,
+		.buffer = dev->ctrlBuf,
 		.size = len,
 	};
 	int ret;
@@ -52,22 +55,82 @@ int usb_devCtrl(usb_dev_t *dev, usb_dir_t dir, usb_setup_packet_t *setup, char *
 	if (len > USBDEV_BUF_SIZE)
 		return -1;
 
-	memcpy(usbdev_common.setupBuf, setup, sizeof(usb_setup_packet_t));
+	/* Control transfers to different devices may be issued by several hub workers at once */
+	mutexLock(dev->ctrlLock);
+	memcpy(dev->setupBuf, setup, sizeof(usb_setup_packet_t));
 	if (dir == usb_dir_out && len > 0)
-		memcpy(usbdev_common.ctrlBuf, buf, len);
+		memcpy(dev->ctrlBuf, buf, len);
 
 	if ((ret = usb_transferSubmit(&t, dev->ctrlPipe, &usbdev_common.cond)) != 0) {
-		mutexUnlock(usbdev_common.lock);
+		mutexUnlock(dev->ctrlLock);
 		return ret;
 	}
 
 	if (t.error == 0 && dir == usb_dir_in && len > 0)
-		memcpy(buf, usbdev_common.ctrlBuf, len);
+		memcpy(buf, dev->ctrlBuf, len);
+	mutexUnlock(dev->ctrlLock);
 
 	return (t.error == 0) ? t.transferred : -t.error;
 }
 
 
+int usb_devCtrlBatch(usb_dev_t *dev, usb_dir_t dir, usb_setup_packet_t *setups, char *buf, size_t len, int n)
+{
+	usb_setup_packet_t *setupBuf;
+	usb_transfer_t *t;
+	char *dataBuf = NULL;
+	int i, queued, ret = 0;
+
+	if ((t = calloc(n, sizeof(usb_transfer_t))) == NULL)
+		return -ENOMEM;
+
+	if ((setupBuf = usb_alloc(n * sizeof(usb_setup_packet_t))) == NULL) {
+		free(t);
+		return -ENOMEM;
+	}
+
+	if (len > 0 && (dataBuf = usb_alloc(n * len)) == NULL) {
+		usb_free(setupBuf, n * sizeof(usb_setup_packet_t));
+		free(t);
+		return -ENOMEM;
+	}
+
+	memcpy(setupBuf, setups, n * sizeof(usb_setup_packet_t));
+	if (dir == usb_dir_out && len > 0)
+		memcpy(dataBuf, buf, n * len);
+
+	/* All requests are queued on the pipe before waiting for the first one */
+	mutexLock(dev->ctrlLock);
+	for (queued = 0; queued < n; queued++) {
+		t[queued].type = usb_transfer_control;
+		t[queued].direction = dir;
+		t[queued].setup = &setupBuf[queued];
+		t[queued].buffer = (dataBuf != NULL) ? dataBuf + queued * len : NULL;
+		t[queued].size = len;
+
+		if ((ret = usb_transferSubmit(&t[queued], dev->ctrlPipe, NULL)) != 0)
+			break;
+	}
+
+	/* Queued requests must complete before their buffers are released */
+	for (i = 0; i < queued; i++) {
+		usb_transferWait(&t[i], usbdev_common.cond);
+		if (t[i].error != 0 && ret == 0)
+			ret = -t[i].error;
+	}
+	mutexUnlock(dev->ctrlLock);
+
+	if (ret == 0 && dir == usb_dir_in && len > 0)
+		memcpy(buf, dataBuf, n * len);
+
+	usb_free(dataBuf, n * len);
+	usb_free(setupBuf, n * sizeof(usb_setup_packet_t));
+	free(t);
+
+	return ret;
+}
+
+
 static int usb_getDescriptor(usb_dev_t *dev, int descriptor, int index, char *buffer, size_t len)
 {
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
@@ -115,6 +178,22 @@ usb_dev_t *usb_devAlloc(void)
 		return NULL;
 	}
 
+	if ((dev->setupBuf = usb_alloc(USBDEV_SETUP_SIZE + USBDEV_BUF_SIZE)) == NULL) {
+		free(ctrlPipe);
+		free(dev);
+		return NULL;
+	}
+
+	if (mutexCreate(&dev->ctrlLock) != 0) {
+		usb_free(dev->setupBuf, USBDEV_SETUP_SIZE + USBDEV_BUF_SIZE);
+		free(ctrlPipe);
+		free(dev);
+		return NULL;
+	}
+
+	dev->ctrlBuf = (char *)dev->setupBuf + USBDEV_SETUP_SIZE;
+	dev->refcnt = 1;
+
 	ctrlPipe->maxPacketLen = 64;
 	ctrlPipe->num = 0;
 	ctrlPipe->dev = dev;
@@ -125,7 +204,7 @@ usb_dev_t *usb_devAlloc(void)
 }
 
 
-void usb_devFree(usb_dev_t *dev)
+static void usb_devFree(usb_dev_t *dev)
 {
 	int i;
 
@@ -137,32 +216,87 @@ void usb_devFree(usb_dev_t *dev)
 	for (i = 0; i < dev->nifs; i++)
 		free(dev->ifs[i].str);
 
-	usb_drvPipeFree(NULL, dev->ctrlPipe);
-	if (dev->statusTransfer != NULL) {
-		usb_drvPipeFree(NULL, dev->irqPipe);
-		usb_free(dev->statusTransfer->buffer, sizeof(uint32_t));
-		free(dev->statusTransfer);
-	}
+	usb_free(dev->setupBuf, USBDEV_SETUP_SIZE + USBDEV_BUF_SIZE);
+	resourceDestroy(dev->ctrlLock);
 
 	free(dev->ifs);
 	free(dev->devs);
+	free(dev->ports);
+	free(dev->changes);
+	free(dev->tts);
+	if (dev->hcd != NULL)
+		hcd_put(dev->hcd);
 	free(dev);
 }
 
 
+static unsigned int usb_devHash(uint64_t locationID)
+{
+	uint32_t h = (uint32_t)locationID ^ (uint32_t)(locationID >> 32);
+
+	h ^= h >> 16;
+	h *= 0x45d9f3bu;
+	h ^= h >> 16;
+
+	return h % USBDEV_HASH_SIZE;
+}
+
+
+static void _usb_devHashAdd(usb_dev_t *dev)
+{
+	unsigned int h = usb_devHash(dev->locationID);
+
+	dev->hashNext = usbdev_common.hash[h];
+	usbdev_common.hash[h] = dev;
+}
+
+
+static void _usb_devHashRemove(usb_dev_t *dev)
+{
+	usb_dev_t **pp = &usbdev_common.hash[usb_devHash(dev->locationID)];
+
+	while (*pp != NULL) {
+		if (*pp == dev) {
+			*pp = dev->hashNext;
+			break;
+		}
+		pp = &(*pp)->hashNext;
+	}
+
+	dev->hashNext = NULL;
+}
+
+
 void usb_devDestroy(usb_dev_t *dev)
 {
 	int i;
 
+	/* Wait for hub workers still handling this hub's ports */
+	if (dev->ports != NULL)
+		hub_destroy(dev);
+
+	/* Children destroyed along with their hub never go through usb_devSetChild() */
+	mutexLock(usbdev_common.hashLock);
+	_usb_devHashRemove(dev);
+	mutexUnlock(usbdev_common.hashLock);
+
 	for (i = 0; i < dev->nports; i++) {
 		if (dev->devs[i] != NULL)
 			usb_devDestroy(dev->devs[i]);
 	}
 
+	/* The hcd may go away along with the tree, lookups may still hold the memory */
+	usb_drvPipeFree(NULL, dev->ctrlPipe);
+	dev->ctrlPipe = NULL;
+	if (dev->statusTransfer != NULL) {
+		usb_drvPipeFree(NULL, dev->irqPipe);
+		hub_statusFree(dev);
+	}
+
 	if (dev->address != 0)
 		hcd_addrFree(dev->hcd, dev->address);
 
-	usb_devFree(dev);
+	usb_devPut(dev);
 }
 
 
@@ -172,7 +306,7 @@ static int usb_genLocationID(usb_dev_t *dev)
 	int tier = 1;
 
 	if (usb_isRoothub(dev)) {
-		dev->locationID = dev->hcd->num & 0xf;
+		dev->locationID = dev->hcd->num & USB_LOCATION_MASK;
 		return 0;
 	}
 
@@ -183,10 +317,10 @@ static int usb_genLocationID(usb_dev_t *dev)
 		tier++;
 	}
 
-	if (tier > 7)
+	if (tier > USB_LOCATION_MAX_TIER || dev->port > USB_LOCATION_MASK)
 		return -1;
 
-	dev->locationID |= dev->port << (4 * tier);
+	dev->locationID |= (uint64_t)dev->port << (USB_LOCATION_BITS * tier);
 
 	return 0;
 }
@@ -418,7 +552,7 @@ static int usb_getAllStringDescs(usb_dev_t *dev)
 }
 
 
-int usb_devEnumerate(usb_dev_t *dev)
+int usb_devAddress(usb_dev_t *dev)
 {
 	int addr;
 
@@ -442,9 +576,20 @@ int usb_devEnumerate(usb_dev_t *dev)
 
 	if (usb_setAddress(dev, addr) < 0) {
 		USB_LOG("usb: Fail to set device address\n");
+		hcd_addrFree(dev->hcd, addr);
 		return -1;
 	}
 
+	return 0;
+}
+
+
+int usb_devEnumerate(usb_dev_t *dev)
+{
+	/* Devices behind hubs are addressed by the hub with the port reset held */
+	if (dev->address == 0 && usb_devAddress(dev) < 0)
+		return -1;
+
 	if (usb_getDevDesc(dev) < 0) {
 		USB_LOG("usb: Fail to get device descriptor\n");
 		return -1;
@@ -460,10 +605,16 @@ int usb_devEnumerate(usb_dev_t *dev)
 		return -1;
 	}
 
-	if (!usb_isRoothub(dev))
+	if (!usb_isRoothub(dev)) {
 		usb_devSetChild(dev->hub, dev->port, dev);
+	}
+	else {
+		mutexLock(usbdev_common.hashLock);
+		_usb_devHashAdd(dev);
+		mutexUnlock(usbdev_common.hashLock);
+	}
 
-	USB_LOG("usb: New device addr: %d locationID: %08x %s, %s\n", dev->address, dev->locationID,
+	USB_LOG("usb: New device addr: %d locationID: %016llx %s, %s\n", dev->address, (unsigned long long)dev->locationID,
 		dev->manufacturer, dev->product);
 
 	if (dev->desc.bDeviceClass == USB_CLASS_HUB) {
@@ -497,38 +648,59 @@ static void usb_devUnbind(usb_dev_t *dev)
 
 void usb_devSetChild(usb_dev_t *parent, int port, usb_dev_t *child)
 {
+	usb_dev_t *old;
+
 	mutexLock(usbdev_common.lock);
+	old = parent->devs[port - 1];
 	parent->devs[port - 1] = child;
+
+	/* Keep the index consistent with the tree */
+	mutexLock(usbdev_common.hashLock);
+	if (old != NULL)
+		_usb_devHashRemove(old);
+	if (child != NULL)
+		_usb_devHashAdd(child);
+	mutexUnlock(usbdev_common.hashLock);
 	mutexUnlock(usbdev_common.lock);
 }
 
 
-usb_dev_t *usb_devFind(usb_dev_t *hub, int locationID)
+usb_dev_t *usb_devFind(uint64_t locationID)
 {
-	usb_dev_t *dev = hub;
-	int port;
+	usb_dev_t *dev;
 
-	mutexLock(usbdev_common.lock);
-	locationID >>= 4;
-	while (locationID != 0) {
-		port = locationID & 0xf;
-		if (port > dev->nports || dev->devs[port - 1] == NULL) {
-			dev = NULL;
-			break;
-		}
-		dev = dev->devs[port - 1];
-		locationID >>= 4;
-	}
-	mutexUnlock(usbdev_common.lock);
+	/* Does not take the enumeration lock */
+	mutexLock(usbdev_common.hashLock);
+	dev = usbdev_common.hash[usb_devHash(locationID)];
+	while (dev != NULL && dev->locationID != locationID)
+		dev = dev->hashNext;
+	if (dev != NULL)
+		dev->refcnt++;
+	mutexUnlock(usbdev_common.hashLock);
 
 	return dev;
 }
 
 
+void usb_devPut(usb_dev_t *dev)
+{
+	int last;
+
+	mutexLock(usbdev_common.hashLock);
+	last = (--dev->refcnt == 0);
+	mutexUnlock(usbdev_common.hashLock);
+
+	if (last)
+		usb_devFree(dev);
+}
+
+
 void usb_devDisconnected(usb_dev_t *dev)
 {
-	printf("usb: Device disconnected addr %d locationID: %08x\n", dev->address, dev->locationID);
-	usb_devSetChild(dev->hub, dev->port, NULL);
+	printf("usb: Device disconnected addr %d locationID: %016llx\n", dev->address, (unsigned long long)dev->locationID);
+	/* Root hubs go away along with their hcd */
+	if (dev->hub != NULL)
+		usb_devSetChild(dev->hub, dev->port, NULL);
 	usb_devUnbind(dev);
 	usb_devDestroy(dev);
 }
@@ -536,7 +708,137 @@ void usb_devDisconnected(usb_dev_t *dev)
 
 void usb_devSignal(void)
 {
-	condSignal(usbdev_common.cond);
+	/* Several workers may wait for their control transfers */
+	condBroadcast(usbdev_common.cond);
+}
+
+
+int usb_devPmGet(usb_dev_t *dev, usb_transfer_t *t)
+{
+	int deferred = 0;
+
+	mutexLock(usbdev_common.pmLock);
+	dev->active++;
+	if (dev->suspended) {
+		LIST_ADD(&dev->deferred, t);
+		deferred = 1;
+	}
+	mutexUnlock(usbdev_common.pmLock);
+
+	if (deferred)
+		hub_devResume(dev);
+
+	return deferred;
+}
+
+
+void usb_devPmPut(usb_dev_t *dev)
+{
+	int idle = 0;
+
+	mutexLock(usbdev_common.pmLock);
+	if (--dev->active == 0) {
+		gettime(&dev->lastActivity, NULL);
+		idle = 1;
+	}
+	mutexUnlock(usbdev_common.pmLock);
+
+	if (idle)
+		hub_devIdle(dev);
+}
+
+
+time_t usb_devPmSuspend(usb_dev_t *dev, time_t now, time_t delay)
+{
+	time_t ret = 0;
+	int i, noSuspend = 0;
+
+	mutexLock(usbdev_common.pmLock);
+	if (dev->lastActivity == 0)
+		dev->lastActivity = now;
+
+	/* Checked with the suspend decision, an opt-out coming later sees the device suspended */
+	for (i = 0; i < dev->nifs; i++)
+		noSuspend |= dev->ifs[i].noSuspend;
+
+	if (noSuspend || dev->active > 0)
+		ret = -1;
+	else if (now - dev->lastActivity < delay)
+		ret = dev->lastActivity + delay;
+	else
+		dev->suspended = 1;
+	mutexUnlock(usbdev_common.pmLock);
+
+	return ret;
+}
+
+
+void usb_devPmNoSuspend(usb_dev_t *dev, int iface, int noSuspend)
+{
+	int resume;
+
+	mutexLock(usbdev_common.pmLock);
+	dev->ifs[iface].noSuspend = noSuspend;
+	resume = noSuspend && dev->suspended;
+	mutexUnlock(usbdev_common.pmLock);
+
+	/* Woken up like by a deferred transfer, it stays active from now on */
+	if (resume)
+		hub_devResume(dev);
+}
+
+
+void usb_devPmResumed(usb_dev_t *dev, int err)
+{
+	usb_transfer_t *deferred, *t;
+	hcd_t *hcd = dev->hcd;
+
+	mutexLock(usbdev_common.pmLock);
+	dev->suspended = 0;
+	deferred = dev->deferred;
+	dev->deferred = NULL;
+	mutexUnlock(usbdev_common.pmLock);
+
+	/* Deferred transfers go to the hcd in submission order */
+	while ((t = deferred) != NULL) {
+		LIST_REMOVE(&deferred, t);
+		if (err != 0 || hcd->ops->transferEnqueue(hcd, t, t->pipe) != 0)
+			usb_transferFinished(t, -EIO);
+	}
+}
+
+
+int usb_devPmCancel(usb_dev_t *dev, usb_pipe_t *pipe, usb_transfer_t *t)
+{
+	usb_transfer_t *cancelled = NULL, *it, *next;
+	int i, n = 0;
+
+	mutexLock(usbdev_common.pmLock);
+	if ((it = dev->deferred) != NULL) {
+		i = 0;
+		do {
+			i++;
+			it = it->next;
+		} while (it != dev->deferred);
+
+		for (; i > 0; i--) {
+			next = it->next;
+			if (it->pipe == pipe && (t == NULL || it == t)) {
+				LIST_REMOVE(&dev->deferred, it);
+				LIST_ADD(&cancelled, it);
+				n++;
+			}
+			it = next;
+		}
+	}
+	mutexUnlock(usbdev_common.pmLock);
+
+	while ((it = cancelled) != NULL) {
+		LIST_REMOVE(&cancelled, it);
+		usb_transferFinished(it, -ECANCELED);
+	}
+
+	return n;
 }
 
 
@@ -559,14 +861,20 @@ int usb_devInit(void)
 		return -ENOMEM;
 	}
 
-	if ((usbdev_common.setupBuf = usb_alloc(USBDEV_BUF_SIZE)) == NULL) {
+	if (mutexCreate(&usbdev_common.hashLock) != 0) {
 		resourceDestroy(usbdev_common.lock);
 		resourceDestroy(usbdev_common.cond);
-		USB_LOG("usbdev: Fail to allocate buffer!\n");
+		USB_LOG("usbdev: Can't create mutex!\n");
 		return -ENOMEM;
 	}
 
-	usbdev_common.ctrlBuf = usbdev_common.setupBuf + 32;
+	if (mutexCreate(&usbdev_common.pmLock) != 0) {
+		resourceDestroy(usbdev_common.lock);
+		resourceDestroy(usbdev_common.cond);
+		resourceDestroy(usbdev_common.hashLock);
+		USB_LOG("usbdev: Can't create mutex!\n");
+		return -ENOMEM;
+	}
 
 	return 0;
 }
@@ -22,6 +22,17 @@
 
 enum usb_speed { usb_full_speed = 0, usb_low_speed, usb_high_speed };
 
+/* Periodic schedule depth tracked for transaction translators, in frames */
+#define USB_TT_FRAMES 32
+
+typedef struct _usb_tt {
+	struct _usb_dev *hub; /* High-speed hub the translator belongs to */
+	int port;             /* Downstream port for multi-TT hubs, 0 for a single TT */
+	int multi;
+	int thinkTime;                 /* In full-speed bit times */
+	uint16_t load[USB_TT_FRAMES]; /* Periodic full-speed byte times reserved per frame */
+} usb_tt_t;
+
 typedef struct {
 	usb_interface_desc_t *desc;
 	usb_endpoint_desc_t *eps;
@@ -29,6 +40,7 @@ typedef struct {
 	char *str;
 
 	struct _usb_drv *driver;
+	int noSuspend; /* Driver opted out of autosuspend, protected by usbdev_common.pmLock */
 } usb_iface_t;
 
 
@@ -42,32 +54,78 @@ typedef struct _usb_dev {
 	uint16_t langId;
 
 	int address;
-	uint32_t locationID;
+	uint64_t locationID;
 	usb_iface_t *ifs;
 	int nifs;
 	usb_pipe_t *ctrlPipe;
+	handle_t ctrlLock;
+	usb_setup_packet_t *setupBuf;
+	char *ctrlBuf;
 
 	struct hcd *hcd;
 	struct _usb_dev *hub;
 	int port;
 
+	/* Translator used by a full/low-speed device behind a high-speed hub */
+	usb_tt_t *tt;
+	int ttPort;
+
+	/* locationID index linkage */
+	struct _usb_dev *hashNext;
+	int refcnt; /* Protected by the index lock, the tree holds one reference */
+
 	/* Hub fields */
 	struct _usb_dev **devs;
 	struct usb_transfer *statusTransfer;
 	usb_pipe_t *irqPipe;
 	int nports;
+	struct _hub_port *ports;
+	uint8_t *changes;
+	usb_tt_t *tts;
+	int ntts;
+	int detached;
+	time_t pwrGood; /* Port power-on to power-good time, in us */
+	int powerScan;  /* Ports status is read in one pass once power is good, hub_common.lock */
+
+	/* Hub event queue linkage */
+	struct _usb_dev *next, *prev;
+	int evPending;
+
+	/* Status transfer re-arm, protected by hub_common.lock, a failed one waits for its retry */
+	struct usb_transfer *statusRearm;
+	int statusBusy; /* Submissions in progress outside of the lock */
+	int statusErrors;
+	time_t statusRetry;
+	struct _usb_dev *tnext, *tprev;
+
+	/* Autosuspend, protected by usbdev_common.pmLock */
+	int active;
+	int suspended;
+	time_t lastActivity;
+	struct usb_transfer *deferred;
 } usb_dev_t;
 
 
-usb_dev_t *usb_devFind(usb_dev_t *hub, int locationID);
+/* Returns a referenced device, released with usb_devPut() */
+usb_dev_t *usb_devFind(uint64_t locationID);
+
+
+void usb_devPut(usb_dev_t *dev);
 
 
 int usb_devCtrl(usb_dev_t *dev, usb_dir_t dir, usb_setup_packet_t *setup, char *buf, size_t len);
 
 
+/* Pipelines n control requests of len bytes each, buf holds n * len bytes */
+int usb_devCtrlBatch(usb_dev_t *dev, usb_dir_t dir, usb_setup_packet_t *setups, char *buf, size_t len, int n);
+
+
 usb_dev_t *usb_devAlloc(void);
 
 
+int usb_devAddress(usb_dev_t *dev);
+
+
 int usb_devEnumerate(usb_dev_t *dev);
 
 
@@ -86,4 +144,26 @@ int usb_isRoothub(usb_dev_t *dev);
 void usb_devSignal(void);
 
 
+/* Accounts a driver transfer, returns 1 if it got deferred until the device resumes */
+int usb_devPmGet(usb_dev_t *dev, usb_transfer_t *t);
+
+
+void usb_devPmPut(usb_dev_t *dev);
+
+
+/* Marks the device suspended if idle for delay, otherwise returns when to retry or -1 if busy or opted out */
+time_t usb_devPmSuspend(usb_dev_t *dev, time_t now, time_t delay);
+
+
+/* Sets the autosuspend opt-out of an interface, opting out resumes a suspended device */
+void usb_devPmNoSuspend(usb_dev_t *dev, int iface, int noSuspend);
+
+
+void usb_devPmResumed(usb_dev_t *dev, int err);
+
+
+/* Cancels deferred transfers of the pipe, or only t if given */
+int usb_devPmCancel(usb_dev_t *dev, usb_pipe_t *pipe, usb_transfer_t *t);
+
+
 #endif /* _USB_DEV_H_ */
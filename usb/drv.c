@@ -25,10 +25,19 @@
 
 #include "drv.h"
 #include "hcd.h"
+#include "hub.h"
+
+#define USBDRV_TIMEOUT_PRIO 3
+
 
 struct {
 	handle_t lock;
 	usb_drv_t *drvs;
+
+	/* Sync transfers with a timeout */
+	handle_t cond;
+	usb_transfer_t *timeouts;
+	char stack[4096] __attribute__((aligned(8)));
 } usbdrv_common;
 
 
@@ -79,6 +88,11 @@ static usb_pipe_t *usb_pipeAlloc(usb_drv_t *drv, usb_dev_t *dev, usb_endpoint_de
 {
 	usb_pipe_t *pipe;
 
+	if (hcd_pipeCheck(dev->hcd, dev, desc) != 0) {
+		USB_LOG("usb: Endpoint %x not supported by the host controller\n", desc->bEndpointAddress);
+		return NULL;
+	}
+
 	if ((pipe = malloc(sizeof(usb_pipe_t))) == NULL)
 		return NULL;
 
@@ -90,25 +104,28 @@ static usb_pipe_t *usb_pipeAlloc(usb_drv_t *drv, usb_dev_t *dev, usb_endpoint_de
 	pipe->interval = desc->bInterval;
 	pipe->hcdpriv = NULL;
 	pipe->drv = drv;
+	pipe->ttFrame = 0;
+	pipe->ttPeriod = 0;
+	pipe->ttLoad = 0;
+
+	if (hcd_ttReserve(pipe) != 0) {
+		USB_LOG("usb: No TT bandwidth for endpoint %x\n", desc->bEndpointAddress);
+		free(pipe);
+		return NULL;
+	}
 
 	return pipe;
 }
 
 
-static usb_pipe_t *_usb_drvPipeOpen(usb_drv_t *drv, hcd_t *hcd, int locationID, int ifaceID, int dir, int type)
+static usb_pipe_t *_usb_drvPipeOpen(usb_drv_t *drv, usb_dev_t *dev, int ifaceID, int dir, int type)
 {
 	usb_endpoint_desc_t *desc;
 	usb_pipe_t *pipe = NULL;
-	usb_dev_t *dev;
 	usb_iface_t *iface;
 	int i;
 
-	if ((dev = usb_devFind(hcd->roothub, locationID)) == NULL) {
-		USB_LOG("usb: Fail to find device\n");
-		return NULL;
-	}
-
-	if (dev->nifs < ifaceID) {
+	if (ifaceID < 0 || ifaceID >= dev->nifs) {
 		USB_LOG("usb: Fail to find iface\n");
 		return NULL;
 	}
@@ -152,23 +169,32 @@ usb_pipe_t *usb_pipeOpen(usb_dev_t *dev, int iface, int dir, int type)
 	usb_pipe_t *pipe = NULL;
 
 	mutexLock(usbdrv_common.lock);
-	pipe = _usb_drvPipeOpen(NULL, dev->hcd, dev->locationID, iface, dir, type);
+	pipe = _usb_drvPipeOpen(NULL, dev, iface, dir, type);
 	mutexUnlock(usbdrv_common.lock);
 
 	return pipe;
 }
 
 
-int usb_drvPipeOpen(usb_drv_t *drv, hcd_t *hcd, int locationID, int iface, int dir, int type)
+int usb_drvPipeOpen(usb_drv_t *drv, uint64_t locationID, int iface, int dir, int type)
 {
 	usb_pipe_t *pipe = NULL;
+	usb_dev_t *dev;
 	int pipeId = -1;
 
+	if ((dev = usb_devFind(locationID)) == NULL) {
+		USB_LOG("usb: Fail to find device\n");
+		return -1;
+	}
+
+	/* Fails on an interface already unbound from drv, the device is then being torn down */
 	mutexLock(usbdrv_common.lock);
-	if ((pipe = _usb_drvPipeOpen(drv, hcd, locationID, iface, dir, type)) != NULL)
+	if ((pipe = _usb_drvPipeOpen(drv, dev, iface, dir, type)) != NULL)
 		pipeId = pipe->linkage.id;
 	mutexUnlock(usbdrv_common.lock);
 
+	usb_devPut(dev);
+
 	return pipeId;
 }
 
@@ -182,8 +208,9 @@ static int _usb_drvTransfer(usb_drv_t *drv, usb_transfer_t *t)
 		return -EINVAL;
 
 	t->type = pipe->type;
+	usb_transferQueue(t, pipe);
 
-	return usb_transferSubmit(t, pipe, NULL);
+	return 0;
 }
 
 
@@ -274,9 +301,124 @@ static usb_drv_t *usb_drvMatchIface(usb_dev_t *dev, usb_iface_t *iface)
 
 static int _usb_urbCancel(usb_transfer_t *t, usb_pipe_t *pipe)
 {
-	hcd_t *hcd = pipe->dev->hcd;
+	/* Transfer may still wait for its device to resume */
+	if (usb_devPmCancel(pipe->dev, pipe, t) == 0)
+		usb_transferCancel(t, pipe);
+
+	return 0;
+}
+
+
+static time_t _usb_timeoutsExpire(time_t now)
+{
+	usb_transfer_t *t, *next;
+	time_t timeout = 0;
+	int i, n = 0;
+
+	if ((t = usbdrv_common.timeouts) == NULL)
+		return 0;
+
+	do {
+		n++;
+		t = t->tnext;
+	} while (t != usbdrv_common.timeouts);
+
+	for (i = 0; i < n; i++) {
+		next = t->tnext;
+		if (t->deadline <= now) {
+			/* Completes with an error, the pipe stays usable */
+			LIST_REMOVE_EX(&usbdrv_common.timeouts, t, tnext, tprev);
+			t->timedOut = 1;
+			_usb_urbCancel(t, t->pipe);
+		}
+		else if (timeout == 0 || t->deadline - now < timeout) {
+			timeout = t->deadline - now;
+		}
+		t = next;
+	}
+
+	return timeout;
+}
+
+
+static void usb_timeoutThread(void *arg)
+{
+	time_t now, timeout;
 
-	hcd->ops->transferDequeue(hcd, t);
+	mutexLock(usbdrv_common.lock);
+	for (;;) {
+		gettime(&now, NULL);
+		timeout = _usb_timeoutsExpire(now);
+		condWait(usbdrv_common.cond, usbdrv_common.lock, timeout);
+	}
+}
+
+
+static void _usb_timeoutStart(usb_transfer_t *t, uint32_t timeout)
+{
+	time_t now;
+
+	gettime(&now, NULL);
+	t->deadline = now + (time_t)timeout * 1000;
+	LIST_ADD_EX(&usbdrv_common.timeouts, t, tnext, tprev);
+	condSignal(usbdrv_common.cond);
+}
+
+
+/* Pipe goes away before the completions of its sync transfers stop their timers */
+static void _usb_timeoutsCancel(usb_pipe_t *pipe)
+{
+	usb_transfer_t *t, *next;
+	int i, n = 0;
+
+	if ((t = usbdrv_common.timeouts) == NULL)
+		return;
+
+	do {
+		n++;
+		t = t->tnext;
+	} while (t != usbdrv_common.timeouts);
+
+	for (i = 0; i < n; i++) {
+		next = t->tnext;
+		if (t->pipe == pipe)
+			LIST_REMOVE_EX(&usbdrv_common.timeouts, t, tnext, tprev);
+		t = next;
+	}
+}
+
+
+int usb_drvTimeoutStop(usb_transfer_t *t)
+{
+	int ret = 0;
+
+	if (t->deadline == 0)
+		return 0;
+
+	mutexLock(usbdrv_common.lock);
+	if (t->tnext != NULL)
+		LIST_REMOVE_EX(&usbdrv_common.timeouts, t, tnext, tprev);
+	if (t->timedOut)
+		ret = -ETIMEDOUT;
+	mutexUnlock(usbdrv_common.lock);
+
+	return ret;
+}
+
+
+static int _usb_pipeCancelAll(usb_drv_t *drv, usb_pipe_t *pipe)
+{
+	rbnode_t *n;
+	usb_transfer_t *t;
+
+	/* Submitted, but not yet flushed to the hcd */
+	usb_transferUnqueue(pipe);
+
+	for (n = lib_rbMinimum(drv->urbs.root); n != NULL; n = lib_rbNext(n)) {
+		t = lib_treeof(usb_transfer_t, linkage, n);
+		if (t->pipeid == usb_pipeid(pipe) && t->state == urb_ongoing)
+			_usb_urbCancel(t, pipe);
+	}
 
 	return 0;
 }
@@ -314,7 +456,11 @@ static void _usb_pipeFree(usb_drv_t *drv, usb_pipe_t *pipe)
 		idtree_remove(&drv->pipes, &pipe->linkage);
 	}
 
+	_usb_timeoutsCancel(pipe);
+	usb_devPmCancel(pipe->dev, pipe, NULL);
+	usb_transferUnqueue(pipe);
 	pipe->dev->hcd->ops->pipeDestroy(pipe->dev->hcd, pipe);
+	hcd_ttRelease(pipe);
 	free(pipe);
 }
 
@@ -328,6 +474,9 @@ int usb_drvUnbind(usb_drv_t *drv, usb_dev_t *dev, int iface)
 
 	mutexLock(usbdrv_common.lock);
 
+	/* Pipe opens looking the device up concurrently fail from now on */
+	dev->ifs[iface].driver = NULL;
+
 	n = lib_rbMinimum(drv->pipes.root);
 	while (n != NULL) {
 		pipe = lib_treeof(usb_pipe_t, linkage, n);
@@ -340,6 +489,7 @@ int usb_drvUnbind(usb_drv_t *drv, usb_dev_t *dev, int iface)
 	mutexUnlock(usbdrv_common.lock);
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_deletion;
+	umsg->version = USB_MSG_VERSION;
 	umsg->deletion.bus = dev->hcd->num;
 	umsg->deletion.dev = dev->address;
 	umsg->deletion.interface = iface;
@@ -354,19 +504,24 @@ int usb_drvBind(usb_dev_t *dev)
 	usb_drv_t *drv;
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
+	usb_devinfo_t info = { 0 };
 	int i;
 
 	msg.type = mtDevCtl;
 	umsg->type = usb_msg_insertion;
-	umsg->insertion.bus = dev->hcd->num;
-	umsg->insertion.dev = dev->address;
-	umsg->insertion.descriptor = dev->desc;
-	umsg->insertion.locationID = dev->locationID;
+	umsg->version = USB_MSG_VERSION;
+
+	info.bus = dev->hcd->num;
+	info.dev = dev->address;
+	info.descriptor = dev->desc;
+	info.locationID = dev->locationID;
+	msg.i.data = &info;
+	msg.i.size = sizeof(info);
 
 	for (i = 0; i < dev->nifs; i++) {
 		if ((drv = usb_drvMatchIface(dev, &dev->ifs[i])) != NULL) {
 			dev->ifs[i].driver = drv;
-			umsg->insertion.interface = i;
+			info.interface = i;
 			msgSend(drv->port, &msg);
 		}
 		/* TODO: Make a device orphaned */
@@ -418,7 +573,7 @@ void usb_drvAdd(usb_drv_t *drv)
 }
 
 
-static usb_transfer_t *usb_transferAlloc(int sync, int type, usb_setup_packet_t *setup, usb_dir_t dir, size_t size, const char *buf)
+static usb_transfer_t *usb_transferAlloc(hcd_t *hcd, int sync, int type, usb_setup_packet_t *setup, usb_dir_t dir, size_t size, const char *buf)
 {
 	usb_transfer_t *t;
 
@@ -429,11 +584,12 @@ static usb_transfer_t *usb_transferAlloc(int sync, int type, usb_setup_packet_t
 	t->direction = dir;
 	t->transferred = 0;
 	t->size = size;
+	t->bufAlign = hcd->caps.dmaAlign;
 	t->state = urb_idle;
 	t->type = type;
 
 	if (size > 0) {
-		if ((t->buffer = usb_alloc(t->size)) == NULL) {
+		if ((t->buffer = usb_allocDma(t->size, t->bufAlign)) == NULL) {
 			free(t);
 			return NULL;
 		}
@@ -442,14 +598,14 @@ static usb_transfer_t *usb_transferAlloc(int sync, int type, usb_setup_packet_t
 	if (type == usb_transfer_control) {
 		t->setup = usb_alloc(sizeof(usb_setup_packet_t));
 		if (t->setup == NULL) {
-			usb_free(t->buffer, t->size);
+			usb_freeDma(t->buffer, t->size, t->bufAlign);
 			free(t);
 			return NULL;
 		}
 		memcpy(t->setup, setup, sizeof(usb_setup_packet_t));
 	}
 
-	if (dir == usb_dir_out && size > 0)
+	if (dir == usb_dir_out && size > 0 && buf != NULL)
 		memcpy(t->buffer, buf, t->size);
 
 	return t;
@@ -458,7 +614,7 @@ static usb_transfer_t *usb_transferAlloc(int sync, int type, usb_setup_packet_t
 
 void usb_transferFree(usb_transfer_t *t)
 {
-	usb_free(t->buffer, t->size);
+	usb_freeDma(t->buffer, t->size, t->bufAlign);
 	usb_free(t->setup, sizeof(usb_setup_packet_t));
 	free(t);
 }
@@ -471,33 +627,25 @@ static int _usb_urbSubmit(usb_transfer_t *t, usb_pipe_t *pipe)
 
 	t->state = urb_ongoing;
 	t->pipeid = usb_pipeid(pipe);
-
-	if (usb_transferSubmit(t, pipe, NULL) < 0) {
-		t->state = urb_idle;
-		return -EIO;
-	}
+	usb_transferQueue(t, pipe);
 
 	return 1;
 }
 
 
-static int _usb_handleUrbcmd(msg_t *msg)
+static int _usb_urbcmdExec(usb_drv_t *drv, const usb_urbcmd_t *urbcmd)
 {
-	usb_msg_t *umsg = (usb_msg_t *)msg->i.raw;
-	usb_urbcmd_t *urbcmd = &umsg->urbcmd;
 	usb_transfer_t *t;
 	usb_pipe_t *pipe;
-	usb_drv_t *drv;
 	int ret;
 
-	drv = _usb_drvFind(msg->pid);
-	if (drv == NULL)
-		return -EINVAL;
-
 	pipe = _usb_pipeFind(drv, urbcmd->pipeid);
 	if (pipe == NULL)
 		return -EINVAL;
 
+	if (urbcmd->cmd == urbcmd_cancelAll)
+		return _usb_pipeCancelAll(drv, pipe);
+
 	t = _usb_transferFind(drv, urbcmd->urbid);
 	if (t == NULL)
 		return -EINVAL;
@@ -530,6 +678,80 @@ static int _usb_handleUrbcmd(msg_t *msg)
 }
 
 
+/* Releases URBs claimed by a vector submit that got rejected */
+static void _usb_urbUnclaim(usb_drv_t *drv, const usb_urbcmd_t *cmds, int n)
+{
+	usb_transfer_t *t;
+	int i;
+
+	for (i = 0; i < n; i++) {
+		if ((t = _usb_transferFind(drv, cmds[i].urbid)) != NULL) {
+			t->state = urb_idle;
+			_usb_transferPut(t);
+		}
+	}
+}
+
+
+/* Vector submit is all or nothing, every URB is claimed before any of them is queued */
+static int _usb_urbSubmitv(usb_drv_t *drv, const usb_urbcmd_t *cmds, int n)
+{
+	usb_transfer_t *t;
+	usb_pipe_t *pipe;
+	int i, ret = 0;
+
+	for (i = 0; i < n && ret == 0; i++) {
+		if (cmds[i].cmd != urbcmd_submit || _usb_pipeFind(drv, cmds[i].pipeid) == NULL) {
+			ret = -EINVAL;
+		}
+		else if ((t = _usb_transferFind(drv, cmds[i].urbid)) == NULL) {
+			ret = -EINVAL;
+		}
+		else {
+			/* Also catches an URB given twice */
+			if (t->state != urb_idle)
+				ret = -EBUSY;
+			else
+				t->state = urb_ongoing;
+			_usb_transferPut(t);
+		}
+	}
+
+	if (ret != 0) {
+		_usb_urbUnclaim(drv, cmds, i - 1);
+		return ret;
+	}
+
+	/* All URBs reach the hcds in one flush, references are handed to them */
+	for (i = 0; i < n; i++) {
+		pipe = _usb_pipeFind(drv, cmds[i].pipeid);
+		t = _usb_transferFind(drv, cmds[i].urbid);
+		if (t->type == usb_transfer_control)
+			memcpy(t->setup, &cmds[i].setup, sizeof(cmds[i].setup));
+		t->pipeid = usb_pipeid(pipe);
+		usb_transferQueue(t, pipe);
+	}
+
+	return n;
+}
+
+
+static int _usb_handleUrbcmd(msg_t *msg)
+{
+	usb_msg_t *umsg = (usb_msg_t *)msg->i.raw;
+	usb_drv_t *drv;
+
+	drv = _usb_drvFind(msg->pid);
+	if (drv == NULL)
+		return -EINVAL;
+
+	if (umsg->urbcmd.cmd != urbcmd_submitv)
+		return _usb_urbcmdExec(drv, &umsg->urbcmd);
+
+	return _usb_urbSubmitv(drv, msg->i.data, msg->i.size / sizeof(usb_urbcmd_t));
+}
+
+
 int usb_handleUrbcmd(msg_t *msg)
 {
 	int ret;
@@ -547,6 +769,7 @@ static int _usb_handleUrb(msg_t *msg, unsigned int port, unsigned long rid)
 	usb_msg_t *umsg = (usb_msg_t *)msg->i.raw;
 	usb_urb_t *urb = &umsg->urb;
 	usb_drv_t *drv;
+	usb_pipe_t *pipe;
 	usb_transfer_t *t;
 	int ret = 0;
 
@@ -555,12 +778,17 @@ static int _usb_handleUrb(msg_t *msg, unsigned int port, unsigned long rid)
 		return -EINVAL;
 	}
 
-	t = usb_transferAlloc(urb->sync, urb->type, &urb->setup, urb->dir, urb->size, msg->i.data);
+	/* Buffers are allocated to suit the controller of the pipe */
+	if ((pipe = _usb_pipeFind(drv, urb->pipe)) == NULL)
+		return -EINVAL;
+
+	t = usb_transferAlloc(pipe->dev->hcd, urb->sync, urb->type, &urb->setup, urb->dir, urb->size, msg->i.data);
 	if (t == NULL)
 		return -ENOMEM;
 
 	t->port = drv->port;
 	t->pipeid = urb->pipe;
+	t->batch = (drv->flags & USB_CONNECT_BATCH) != 0;
 
 	/* For async urbs only allocate resources. The transfer would be executed,
 	 * upon receiving usb_submit_t msg later */
@@ -577,7 +805,13 @@ static int _usb_handleUrb(msg_t *msg, unsigned int port, unsigned long rid)
 		t->rid = rid;
 		t->pid = msg->pid;
 
+		/* Armed before queueing, the transfer may complete at once */
+		if (urb->timeout != 0)
+			_usb_timeoutStart(t, urb->timeout);
+
 		if (_usb_drvTransfer(drv, t) < 0) {
+			if (t->tnext != NULL)
+				LIST_REMOVE_EX(&usbdrv_common.timeouts, t, tnext, tprev);
 			usb_transferFree(t);
 			return -EINVAL;
 		}
@@ -601,6 +835,34 @@ int usb_handleUrb(msg_t *msg, unsigned int port, unsigned long rid)
 }
 
 
+int usb_handleAutosuspend(msg_t *msg)
+{
+	usb_msg_t *umsg = (usb_msg_t *)msg->i.raw;
+	usb_autosuspend_t *as = &umsg->autosuspend;
+	usb_drv_t *drv;
+	usb_dev_t *dev;
+	int ret = 0;
+
+	if ((dev = usb_devFind(as->locationID)) == NULL)
+		return -ENODEV;
+
+	mutexLock(usbdrv_common.lock);
+	if ((drv = _usb_drvFind(msg->pid)) == NULL || as->iface < 0 || as->iface >= dev->nifs ||
+			dev->ifs[as->iface].driver != drv) {
+		ret = -EINVAL;
+	}
+	else {
+		/* Bound, so its hub still exists */
+		usb_devPmNoSuspend(dev, as->iface, !as->enable);
+	}
+	mutexUnlock(usbdrv_common.lock);
+
+	usb_devPut(dev);
+
+	return ret;
+}
+
+
 void usb_drvPipeFree(usb_drv_t *drv, usb_pipe_t *pipe)
 {
 	mutexLock(usbdrv_common.lock);
@@ -618,5 +880,18 @@ int usb_drvInit(void)
 		return -ENOMEM;
 	}
 
+	if (condCreate(&usbdrv_common.cond) != 0) {
+		resourceDestroy(usbdrv_common.lock);
+		USB_LOG("usbdrv: Can't create cond!\n");
+		return -ENOMEM;
+	}
+
+	if (beginthread(usb_timeoutThread, USBDRV_TIMEOUT_PRIO, usbdrv_common.stack, sizeof(usbdrv_common.stack), NULL) != 0) {
+		resourceDestroy(usbdrv_common.cond);
+		resourceDestroy(usbdrv_common.lock);
+		USB_LOG("usbdrv: Can't start timeout thread!\n");
+		return -ENOMEM;
+	}
+
 	return 0;
 }
@@ -23,6 +23,7 @@ typedef struct _usb_drv {
 	struct _usb_drv *next, *prev;
 	pid_t pid;
 	unsigned port;
+	unsigned flags;
 	unsigned nfilters;
 	usb_device_id_t *filters;
 	idtree_t pipes;
@@ -45,7 +46,7 @@ int usb_drvUnbind(usb_drv_t *drv, usb_dev_t *dev, int iface);
 int usb_drvInit(void);
 
 
-int usb_drvPipeOpen(usb_drv_t *drv, hcd_t *hcd, int locationID, int iface, int dir, int type);
+int usb_drvPipeOpen(usb_drv_t *drv, uint64_t locationID, int iface, int dir, int type);
 
 
 usb_pipe_t *usb_pipeOpen(usb_dev_t *dev, int iface, int dir, int type);
@@ -68,4 +69,11 @@ int usb_handleUrbcmd(msg_t *msg);
 
 int usb_handleUrb(msg_t *msg, unsigned int port, unsigned long rid);
 
+
+int usb_handleAutosuspend(msg_t *msg);
+
+
+/* Stops the timeout of a sync transfer, returns -ETIMEDOUT if it has already expired */
+int usb_drvTimeoutStop(usb_transfer_t *t);
+
 #endif /* _USB_DRV_H_ */
@@ -13,9 +13,11 @@
 
 #include <errno.h>
 #include <sys/list.h>
+#include <sys/minmax.h>
 #include <sys/threads.h>
 #include <string.h>
 #include <stdlib.h>
+#include <stdio.h>
 
 #include "usbhost.h"
 #include "dev.h"
@@ -28,8 +30,44 @@ struct hcd_ops_node {
 };
 
 
+#define HCD_MAX 16
+
+#define HCD_INIT_THREADS 4
+#define HCD_INIT_PRIO    3
+#define HCD_INIT_STACK   8192 /* Backend init and root hub enumeration, printf included */
+#define HCD_REQUESTS     8
+
+/* 90% of a full-speed frame may be used by periodic transfers, in byte times */
+#define HCD_TT_FRAME_BUDGET 1350
+
+/* Default capabilities */
+#define HCD_DMA_ALIGN 32
+#define HCD_FRAMES    1024
+
+
 static struct {
 	struct hcd_ops_node *ops;
+	hcd_t *byNum[HCD_MAX];
+	hcd_t *hcds;
+	handle_t lock;
+	handle_t ttLock;
+
+	/* Controllers yet to be initialized */
+	const hcd_info_t *info;
+	int ninfo;
+	int next;
+	uint32_t nums; /* Bus numbers in use */
+	const hcd_info_t *claimed[HCD_MAX]; /* Controller of each bus number, set before it comes up */
+
+	/* Runtime attach and detach requests, handled by the init threads */
+	handle_t cond;
+	struct {
+		int attach;
+		int arg;
+	} reqs[HCD_REQUESTS];
+	int nreqs;
+
+	char stack[HCD_INIT_THREADS][HCD_INIT_STACK] __attribute__((aligned(8)));
 } hcd_common;
 
 
@@ -38,25 +76,33 @@ int hcd_addrAlloc(hcd_t *hcd)
 	uint32_t b, addr;
 	int i;
 
+	mutexLock(hcd->addrLock);
+
 	/* Allocate address */
 	for (i = 0, addr = 0; i < 4; i++, addr += 32) {
 		if ((b = __builtin_ffsl(~hcd->addrmask[i])) != 0)
 			break;
 	}
 
-	if (b == 0)
+	if (b == 0) {
+		mutexUnlock(hcd->addrLock);
 		return -1;
+	}
 
 	addr += b - 1;
 	hcd->addrmask[i] |= 1UL << (b - 1UL);
 
+	mutexUnlock(hcd->addrLock);
+
 	return addr;
 }
 
 
 void hcd_addrFree(hcd_t *hcd, int addr)
 {
+	mutexLock(hcd->addrLock);
 	hcd->addrmask[addr / 32] &= ~(1UL << (addr % 32));
+	mutexUnlock(hcd->addrLock);
 }
 
 
@@ -91,7 +137,11 @@ static const hcd_ops_t *hcd_lookup(const char *type)
 
 static void hcd_free(hcd_t *hcd)
 {
+	resourceDestroy(hcd->completion.chunksCond);
+	resourceDestroy(hcd->completion.cond);
+	resourceDestroy(hcd->completion.lock);
 	resourceDestroy(hcd->transLock);
+	resourceDestroy(hcd->addrLock);
 	free(hcd);
 }
 
@@ -99,7 +149,7 @@ static hcd_t *hcd_create(const hcd_ops_t *ops, const hcd_info_t *info, int num)
 {
 	hcd_t *hcd;
 
-	if ((hcd = malloc(sizeof(hcd_t))) == NULL)
+	if ((hcd = calloc(1, sizeof(hcd_t))) == NULL)
 		return NULL;
 
 	if (mutexCreate(&hcd->transLock) != 0) {
@@ -107,12 +157,51 @@ static hcd_t *hcd_create(const hcd_ops_t *ops, const hcd_info_t *info, int num)
 		return NULL;
 	}
 
+	if (mutexCreate(&hcd->addrLock) != 0) {
+		resourceDestroy(hcd->transLock);
+		free(hcd);
+		return NULL;
+	}
+
+	if (mutexCreate(&hcd->completion.lock) != 0) {
+		resourceDestroy(hcd->addrLock);
+		resourceDestroy(hcd->transLock);
+		free(hcd);
+		return NULL;
+	}
+
+	if (condCreate(&hcd->completion.cond) != 0) {
+		resourceDestroy(hcd->completion.lock);
+		resourceDestroy(hcd->addrLock);
+		resourceDestroy(hcd->transLock);
+		free(hcd);
+		return NULL;
+	}
+
+	if (condCreate(&hcd->completion.chunksCond) != 0) {
+		resourceDestroy(hcd->completion.cond);
+		resourceDestroy(hcd->completion.lock);
+		resourceDestroy(hcd->addrLock);
+		resourceDestroy(hcd->transLock);
+		free(hcd);
+		return NULL;
+	}
+
 	hcd->info = info;
+	hcd->refcnt = 1;
 	hcd->priv = NULL;
 	hcd->transfers = NULL;
+	hcd->enumOwner = NULL;
 	hcd->ops = ops;
 	hcd->num = num;
 
+	/* What the core assumed before controllers described themselves */
+	hcd->caps.maxTransfer = 0;
+	hcd->caps.dmaAlign = HCD_DMA_ALIGN;
+	hcd->caps.frames = HCD_FRAMES;
+	hcd->caps.speed = usb_high_speed;
+	hcd->caps.flags = HCD_CAP_ISO;
+
 	/*
 	 * 0 address is reserved for the enumerating device,
 	 */
@@ -125,19 +214,184 @@ static hcd_t *hcd_create(const hcd_ops_t *ops, const hcd_info_t *info, int num)
 }
 
 
-hcd_t *hcd_find(hcd_t *hcdList, uint32_t locationID)
+hcd_t *hcd_find(uint64_t locationID)
 {
-	hcd_t *hcd = hcdList;
+	unsigned int num = USB_LOCATION_BUS(locationID);
+	hcd_t *hcd = NULL;
+
+	if (num < HCD_MAX) {
+		mutexLock(hcd_common.lock);
+		if ((hcd = hcd_common.byNum[num]) != NULL)
+			hcd->refcnt++;
+		mutexUnlock(hcd_common.lock);
+	}
 
-	do {
-		if ((locationID & 0xf) == hcd->num)
+	return hcd;
+}
+
+
+void hcd_get(hcd_t *hcd)
+{
+	mutexLock(hcd_common.lock);
+	hcd->refcnt++;
+	mutexUnlock(hcd_common.lock);
+}
+
+
+void hcd_put(hcd_t *hcd)
+{
+	int last;
+
+	mutexLock(hcd_common.lock);
+	last = (--hcd->refcnt == 0);
+	mutexUnlock(hcd_common.lock);
+
+	if (last)
+		hcd_free(hcd);
+}
+
+
+static int hcd_ttPeriod(usb_pipe_t *pipe)
+{
+	int period = 1;
+	int interval = max(pipe->interval, 1);
+	int frames = min(USB_TT_FRAMES, pipe->dev->hcd->caps.frames);
+
+	if (pipe->type == usb_transfer_isochronous)
+		interval = 1 << min(interval - 1, 15);
+
+	/* Longer periods are not expressible in the controller frame list */
+	while (period * 2 <= interval && period * 2 <= frames)
+		period *= 2;
+
+	return period;
+}
+
+
+static int hcd_ttCost(usb_pipe_t *pipe, usb_tt_t *tt)
+{
+	int len = pipe->maxPacketLen;
+	int cost;
+
+	/* Worst case bit stuffing and protocol overhead, in full-speed byte times */
+	if (pipe->dev->speed == usb_low_speed)
+		cost = 99 + (len * 19) / 2;
+	else if (pipe->type == usb_transfer_isochronous)
+		cost = 11 + (len * 7) / 6;
+	else
+		cost = 14 + (len * 7) / 6;
+
+	return cost + (tt->thinkTime + 7) / 8;
+}
+
+
+int hcd_ttReserve(usb_pipe_t *pipe)
+{
+	usb_tt_t *tt = pipe->dev->tt;
+	int period, cost, frame, f, load;
+	int best = -1, bestLoad = 0;
+
+	if (tt == NULL || (pipe->type != usb_transfer_interrupt && pipe->type != usb_transfer_isochronous))
+		return 0;
+
+	period = hcd_ttPeriod(pipe);
+	cost = hcd_ttCost(pipe, tt);
+
+	mutexLock(hcd_common.ttLock);
+
+	/* Pick the least loaded phase the transfer fits in */
+	for (frame = 0; frame < period; frame++) {
+		load = 0;
+		for (f = frame; f < USB_TT_FRAMES; f += period)
+			load = max(load, tt->load[f]);
+
+		if (load + cost <= HCD_TT_FRAME_BUDGET && (best < 0 || load < bestLoad)) {
+			best = frame;
+			bestLoad = load;
+		}
+	}
+
+	if (best < 0) {
+		mutexUnlock(hcd_common.ttLock);
+		return -ENOSPC;
+	}
+
+	for (f = best; f < USB_TT_FRAMES; f += period)
+		tt->load[f] += cost;
+
+	mutexUnlock(hcd_common.ttLock);
+
+	pipe->ttFrame = best;
+	pipe->ttPeriod = period;
+	pipe->ttLoad = cost;
+
+	return 0;
+}
+
+
+void hcd_ttRelease(usb_pipe_t *pipe)
+{
+	usb_tt_t *tt = pipe->dev->tt;
+	int f;
+
+	if (tt == NULL || pipe->ttLoad == 0)
+		return;
+
+	mutexLock(hcd_common.ttLock);
+	for (f = pipe->ttFrame; f < USB_TT_FRAMES; f += pipe->ttPeriod)
+		tt->load[f] -= pipe->ttLoad;
+	mutexUnlock(hcd_common.ttLock);
+
+	pipe->ttLoad = 0;
+}
+
+
+int hcd_pipeCheck(hcd_t *hcd, usb_dev_t *dev, const usb_endpoint_desc_t *desc)
+{
+	if ((desc->bmAttributes & 0x3) == usb_transfer_isochronous && (hcd->caps.flags & HCD_CAP_ISO) == 0)
+		return -ENOTSUP;
+
+	/* High-speed packets need a high-speed capable controller */
+	if (dev->speed == usb_high_speed && hcd->caps.speed != usb_high_speed)
+		return -ENOTSUP;
+
+	if (hcd->caps.maxTransfer != 0 && (desc->wMaxPacketSize & 0x7ff) > hcd->caps.maxTransfer)
+		return -EINVAL;
+
+	return 0;
+}
+
+
+int hcd_diag(char *buf, size_t size)
+{
+	static const char *speeds[] = { "full", "low", "high" };
+	size_t len = 0;
+	hcd_t *hcd;
+	int i, ret;
+
+	mutexLock(hcd_common.lock);
+	for (i = 0; i < HCD_MAX && len < size; i++) {
+		if ((hcd = hcd_common.byNum[i]) == NULL)
+			continue;
+
+		ret = snprintf(buf + len, size - len, "hcd: %d %s speed %s max transfer %zu align %zu frames %u%s%s\n",
+			hcd->num, hcd->info->type, speeds[hcd->caps.speed], hcd->caps.maxTransfer, hcd->caps.dmaAlign, hcd->caps.frames,
+			(hcd->caps.flags & HCD_CAP_SG) ? " sg" : "", (hcd->caps.flags & HCD_CAP_ISO) ? " iso" : "");
+		if (ret < 0 || (len += ret) >= size)
 			break;
-	} while ((hcd = hcd->next) != hcdList);
 
-	if ((locationID & 0xf) != hcd->num)
-		return NULL;
+		mutexLock(hcd->completion.lock);
+		ret = snprintf(buf + len, size - len, "hcd: %d completions %u wakeups %u poll rounds %u mode switches %u backlog max %u %s\n",
+			hcd->num, hcd->completion.completions, hcd->completion.wakeups, hcd->completion.rounds, hcd->completion.switches,
+			hcd->completion.backlogMax, hcd->completion.polling ? "polling" : "interrupt");
+		mutexUnlock(hcd->completion.lock);
+		if (ret < 0)
+			break;
+		len += ret;
+	}
+	mutexUnlock(hcd_common.lock);
 
-	return hcd;
+	return min(len, size);
 }
 
 
@@ -152,47 +406,274 @@ static int hcd_roothubInit(hcd_t *hcd)
 	hub->hub = NULL;
 	hub->port = 1;
 	hub->hcd = hcd;
+	hcd_get(hcd);
 
 	return usb_devEnumerate(hub);
 }
 
 
-hcd_t *hcd_init(void)
+/* Lowest bus number not in use claimed for info, hcd_common.lock held */
+static int _hcd_numAlloc(const hcd_info_t *info)
 {
-	const hcd_info_t *info;
-	const hcd_ops_t *ops;
-	hcd_t *hcd, *res = NULL;
-	int nhcd, i;
-	int num = 1;
+	int num;
 
-	if ((nhcd = hcd_getInfo(&info)) <= 0)
-		return NULL;
+	for (num = 1; num < HCD_MAX; num++) {
+		if (hcd_common.claimed[num] == info)
+			return -EBUSY;
+	}
 
-	for (i = 0; i < nhcd; i++) {
-		if ((ops = hcd_lookup(info[i].type)) == NULL) {
-			USB_LOG("usb-hcd: No ops found for hcd type %s\n", info[i].type);
-			continue;
+	for (num = 1; num < HCD_MAX; num++) {
+		if ((hcd_common.nums & (1u << num)) == 0) {
+			hcd_common.nums |= 1u << num;
+			hcd_common.claimed[num] = info;
+			return num;
 		}
+	}
+
+	return -ENOSPC;
+}
+
+
+static void hcd_numFree(int num)
+{
+	mutexLock(hcd_common.lock);
+	hcd_common.nums &= ~(1u << num);
+	hcd_common.claimed[num] = NULL;
+	mutexUnlock(hcd_common.lock);
+}
+
+
+static void hcd_teardown(hcd_t *hcd)
+{
+	/* Controller stops first, the status thread then drains what it completed */
+	if (hcd->ops->deinit != NULL)
+		hcd->ops->deinit(hcd);
+
+	usb_statusStop(hcd);
+
+	/* Memory goes away with the last device still referring to it */
+	hcd_numFree(hcd->num);
+	hcd_put(hcd);
+}
+
+
+static int hcd_bringUp(const hcd_ops_t *ops, const hcd_info_t *info, int num)
+{
+	hcd_t *hcd;
+
+	if ((hcd = hcd_create(ops, info, num)) == NULL) {
+		USB_LOG("usb-hcd: Not enough memory to allocate hcd type: %s\n", info->type);
+		hcd_numFree(num);
+		return -ENOMEM;
+	}
+
+	if (hcd->ops->init(hcd) != 0) {
+		USB_LOG("usb-hcd: Fail to initialize hcd type: %s\n", info->type);
+		hcd_numFree(num);
+		hcd_put(hcd);
+		return -EIO;
+	}
+
+	if (usb_statusStart(hcd) != 0) {
+		USB_LOG("usb-hcd: Fail to start status thread: %s\n", info->type);
+		if (hcd->ops->deinit != NULL)
+			hcd->ops->deinit(hcd);
+		hcd_numFree(num);
+		hcd_put(hcd);
+		return -ENOMEM;
+	}
+
+	if (hcd_roothubInit(hcd) != 0) {
+		USB_LOG("usb-hcd: Fail to initialize roothub: %s\n", info->type);
+		hcd_teardown(hcd);
+		return -EIO;
+	}
+
+	mutexLock(hcd_common.lock);
+	LIST_ADD(&hcd_common.hcds, hcd);
+	hcd_common.byNum[hcd->num] = hcd;
+	mutexUnlock(hcd_common.lock);
+
+	return num;
+}
+
+
+int hcd_attach(const hcd_info_t *info)
+{
+	const hcd_ops_t *ops;
+	int num;
+
+	if ((ops = hcd_lookup(info->type)) == NULL) {
+		USB_LOG("usb-hcd: No ops found for hcd type %s\n", info->type);
+		return -ENOENT;
+	}
+
+	/* Claimed until detached, concurrent requests for the same controller fail with -EBUSY */
+	mutexLock(hcd_common.lock);
+	num = _hcd_numAlloc(info);
+	mutexUnlock(hcd_common.lock);
+
+	if (num < 0)
+		return num;
+
+	return hcd_bringUp(ops, info, num);
+}
+
+
+int hcd_detach(int num)
+{
+	hcd_t *hcd = NULL;
+
+	/* No longer visible, traffic of other controllers goes on */
+	mutexLock(hcd_common.lock);
+	if (num > 0 && num < HCD_MAX && (hcd = hcd_common.byNum[num]) != NULL) {
+		hcd_common.byNum[num] = NULL;
+		LIST_REMOVE(&hcd_common.hcds, hcd);
+	}
+	mutexUnlock(hcd_common.lock);
+
+	if (hcd == NULL)
+		return -ENODEV;
+
+	USB_LOG("usb-hcd: Detaching hcd %d type: %s\n", num, hcd->info->type);
+
+	/* Drivers are unbound, pipes destroyed and addresses released while the hardware still runs */
+	usb_devDisconnected(hcd->roothub);
+	hcd_teardown(hcd);
+
+	return 0;
+}
 
-		if ((hcd = hcd_create(ops, &info[i], num++)) == NULL) {
-			USB_LOG("usb-hcd: Not enough memory to allocate hcd type: %s\n", info[i].type);
-			return res;
+
+static int hcd_attachInfo(int index)
+{
+	if (index < 0 || index >= hcd_common.ninfo)
+		return -EINVAL;
+
+	return hcd_attach(&hcd_common.info[index]);
+}
+
+
+static int hcd_request(int attach, int arg)
+{
+	int ret = 0;
+
+	mutexLock(hcd_common.lock);
+	if (hcd_common.nreqs == HCD_REQUESTS) {
+		ret = -EBUSY;
+	}
+	else {
+		hcd_common.reqs[hcd_common.nreqs].attach = attach;
+		hcd_common.reqs[hcd_common.nreqs].arg = arg;
+		hcd_common.nreqs++;
+		condSignal(hcd_common.cond);
+	}
+	mutexUnlock(hcd_common.lock);
+
+	return ret;
+}
+
+
+int hcd_attachRequest(int index)
+{
+	return hcd_request(1, index);
+}
+
+
+int hcd_detachRequest(int num)
+{
+	return hcd_request(0, num);
+}
+
+
+/* Brings up controllers of hcd_getInfo(), a persistent worker then serves runtime requests */
+static void hcd_initWorker(int persist)
+{
+	const hcd_info_t *info;
+	const hcd_ops_t *ops;
+	int num, attach, arg, ret;
+
+	for (;;) {
+		/* Controllers are numbered in hcd_getInfo() order regardless of init timing */
+		mutexLock(hcd_common.lock);
+		ops = NULL;
+		while (ops == NULL && hcd_common.next < hcd_common.ninfo) {
+			info = &hcd_common.info[hcd_common.next++];
+			if ((ops = hcd_lookup(info->type)) == NULL)
+				USB_LOG("usb-hcd: No ops found for hcd type %s\n", info->type);
 		}
 
-		if (hcd->ops->init(hcd) != 0) {
-			USB_LOG("usb-hcd: Fail to initialize hcd type: %s\n", info[i].type);
-			hcd_free(hcd);
+		if (ops != NULL) {
+			num = _hcd_numAlloc(info);
+			mutexUnlock(hcd_common.lock);
+
+			if (num >= 0)
+				hcd_bringUp(ops, info, num);
 			continue;
 		}
 
-		if (hcd_roothubInit(hcd) != 0) {
-			USB_LOG("usb-hcd: Fail to initialize roothub: %s\n", info[i].type);
-			hcd_free(hcd);
-			continue;
+		if (!persist) {
+			mutexUnlock(hcd_common.lock);
+			break;
 		}
 
-		LIST_ADD(&res, hcd);
+		while (hcd_common.nreqs == 0)
+			condWait(hcd_common.cond, hcd_common.lock, 0);
+
+		attach = hcd_common.reqs[0].attach;
+		arg = hcd_common.reqs[0].arg;
+		hcd_common.nreqs--;
+		memmove(&hcd_common.reqs[0], &hcd_common.reqs[1], hcd_common.nreqs * sizeof(hcd_common.reqs[0]));
+		mutexUnlock(hcd_common.lock);
+
+		ret = attach ? hcd_attachInfo(arg) : hcd_detach(arg);
+		if (ret < 0)
+			USB_LOG("usb-hcd: Fail to %s hcd %d: %d\n", attach ? "attach" : "detach", arg, ret);
 	}
+}
+
+
+static void hcd_initThread(void *arg)
+{
+	hcd_initWorker(1);
+	endthread();
+}
+
+
+int hcd_init(void)
+{
+	int i, nthreads;
+
+	if (mutexCreate(&hcd_common.ttLock) != 0)
+		return -ENOMEM;
+
+	if (mutexCreate(&hcd_common.lock) != 0) {
+		resourceDestroy(hcd_common.ttLock);
+		return -ENOMEM;
+	}
+
+	if (condCreate(&hcd_common.cond) != 0) {
+		resourceDestroy(hcd_common.lock);
+		resourceDestroy(hcd_common.ttLock);
+		return -ENOMEM;
+	}
+
+	/* Controllers may also be attached later on */
+	hcd_common.ninfo = max(hcd_getInfo(&hcd_common.info), 0);
+	hcd_common.next = 0;
+	hcd_common.nums = 0;
+	memset(hcd_common.claimed, 0, sizeof(hcd_common.claimed));
+
+	/* Root hubs come up concurrently, each controller is brought up by one of the threads.
+	 * They stay to serve attach and detach requests, at least one is needed for them */
+	nthreads = max(min(hcd_common.ninfo, HCD_INIT_THREADS), 1);
+	for (i = 0; i < nthreads; i++) {
+		if (beginthread(hcd_initThread, HCD_INIT_PRIO, hcd_common.stack[i], sizeof(hcd_common.stack[i]), NULL) != 0)
+			break;
+	}
+
+	if (i == 0)
+		hcd_initWorker(0);
 
-	return res;
+	return 0;
 }
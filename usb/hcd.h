@@ -20,6 +20,9 @@
 
 #define HCD_TYPE_LEN 5
 
+/* Upper bound of transfers passed to transferEnqueueBatch */
+#define USB_BATCH_MAX 32
+
 typedef struct {
 	char type[HCD_TYPE_LEN];
 	uintptr_t hcdaddr;
@@ -28,14 +31,66 @@ typedef struct {
 	int clk;
 } hcd_info_t;
 
+#define HCD_CAP_SG  (1 << 0) /* Scatter-gather transfer buffers */
+#define HCD_CAP_ISO (1 << 1) /* Isochronous transfers */
+
+/* Filled in by hcd_ops_t.init, defaults are set by the core beforehand */
+typedef struct {
+	size_t maxTransfer;   /* Largest transfer accepted at once, 0 - unlimited */
+	size_t dmaAlign;      /* Transfer buffer alignment */
+	unsigned int frames;  /* Periodic frame list size */
+	enum usb_speed speed; /* Highest speed of the root ports */
+	unsigned int flags;
+} hcd_caps_t;
+
+/* Driver transfers completed on a controller, handled by its own status thread */
+typedef struct {
+	handle_t lock;
+	handle_t cond;
+	usb_transfer_t *finished;
+	usb_transfer_t *chunks; /* Split transfers waiting for their next chunk to be queued */
+	int chunksBusy;         /* Status thread is queueing taken chunks */
+	handle_t chunksCond;
+	handle_t tid;
+	int stop;
+
+	/* Adaptive completion mode, see usb_statusthr() */
+	int polling;
+	unsigned int backlog;
+	unsigned int completions;
+	unsigned int wakeups;
+	unsigned int rounds;
+	unsigned int switches;
+	unsigned int backlogMax;
+
+	/* Queueing chunks goes down into the hcd */
+	char stack[4096] __attribute__((aligned(8)));
+} hcd_completion_t;
+
+/* Lock-free submission queue, any number of submitters and a single consumer
+ * (the thread scheduling transfers on the hardware) */
+typedef struct {
+	usb_transfer_t *head;
+	int waiting;
+} hcd_queue_t;
+
 typedef struct hcd_ops {
 	const char type[HCD_TYPE_LEN];
 
+	/* Runs on an init thread or in the hcd_attach() caller. Controllers come up concurrently,
+	 * init of two controllers of the same type may overlap, shared backend state needs a lock */
 	int (*init)(struct hcd *);
+	/* Optional, stops the controller detached with hcd_detach() */
+	void (*deinit)(struct hcd *);
 	int (*transferEnqueue)(struct hcd *, usb_transfer_t *, usb_pipe_t *);
+	/* Optional, enqueues transfers of any pipes (t->pipe) with a single doorbell write.
+	 * Returns the number of leading transfers accepted */
+	int (*transferEnqueueBatch)(struct hcd *, usb_transfer_t **, int);
 	void (*transferDequeue)(struct hcd *, usb_transfer_t *);
 	void (*pipeDestroy)(struct hcd *, usb_pipe_t *);
 	uint32_t (*getRoothubStatus)(usb_dev_t *);
+	/* Optional, coalesces completion interrupts while the core polls for completions */
+	void (*setModeration)(struct hcd *, int);
 } hcd_ops_t;
 
 typedef struct hcd {
@@ -44,10 +99,16 @@ typedef struct hcd {
 	const hcd_ops_t *ops;
 	usb_dev_t *roothub;
 	int num;
+	int refcnt; /* Held by the registry and every device of the controller */
+	hcd_caps_t caps;
+	hcd_completion_t completion;
 
 	uint32_t addrmask[4];
+	handle_t addrLock;
+	void *enumOwner; /* Hub port holding the default address */
 	usb_transfer_t *transfers;
 	handle_t transLock;
+	hcd_queue_t queue;
 	volatile int *base, *phybase;
 	void *priv;
 } hcd_t;
@@ -61,9 +122,104 @@ int hcd_addrAlloc(hcd_t *hcd);
 
 void hcd_addrFree(hcd_t *hcd, int addr);
 
-hcd_t *hcd_find(hcd_t *hcdList, uint32_t locationID);
+/* Returns a referenced controller, released with hcd_put() */
+hcd_t *hcd_find(uint64_t locationID);
+
+
+void hcd_get(hcd_t *hcd);
+
+
+/* Frees a detached controller once its last reference is gone */
+void hcd_put(hcd_t *hcd);
+
+/* Starts initialization of all controllers, their root hubs are enumerated in the background */
+int hcd_init(void);
+
+
+/* Brings up a controller at runtime, info has to stay valid until it is detached.
+ * Returns the controller bus number or -EBUSY if info is attached or still being detached.
+ * Backend hook, the caller must not serve usb messages */
+int hcd_attach(const hcd_info_t *info);
+
+
+/* Disconnects the whole device tree of a controller and removes it, same context as hcd_attach() */
+int hcd_detach(int num);
+
+
+/* Queue hcd_attach() of an hcd_getInfo() entry or hcd_detach() of a bus for the init threads,
+ * used by the message thread which has to keep serving drivers while their devices go away */
+int hcd_attachRequest(int index);
+
+
+int hcd_detachRequest(int num);
+
+
+/* Checks whether the controller can serve an endpoint of a device */
+int hcd_pipeCheck(hcd_t *hcd, usb_dev_t *dev, const usb_endpoint_desc_t *desc);
+
+
+int hcd_diag(char *buf, size_t size);
+
+
+/* Returns 1 if the consumer is waiting and has to be signalled under its lock */
+static inline int hcd_queuePush(hcd_queue_t *q, usb_transfer_t *t)
+{
+	usb_transfer_t *head = __atomic_load_n(&q->head, __ATOMIC_RELAXED);
+
+	do {
+		t->qnext = head;
+	} while (!__atomic_compare_exchange_n(&q->head, &head, t, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+	return __atomic_exchange_n(&q->waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+
+/* Consumer only, returns all queued transfers linked by qnext in submission order */
+static inline usb_transfer_t *hcd_queueTake(hcd_queue_t *q)
+{
+	usb_transfer_t *t = __atomic_exchange_n(&q->head, NULL, __ATOMIC_ACQUIRE);
+	usb_transfer_t *fifo = NULL, *next;
+
+	while (t != NULL) {
+		next = t->qnext;
+		t->qnext = fifo;
+		fifo = t;
+		t = next;
+	}
+
+	return fifo;
+}
+
+
+/* Consumer only, called with its lock held right before waiting.
+ * Returns 0 if transfers arrived meanwhile and the wait has to be skipped */
+static inline int hcd_queueIdle(hcd_queue_t *q)
+{
+	__atomic_store_n(&q->waiting, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&q->head, __ATOMIC_SEQ_CST) == NULL)
+		return 1;
+
+	__atomic_store_n(&q->waiting, 0, __ATOMIC_RELAXED);
+
+	return 0;
+}
+
+
+/* Starts the status thread of a controller, implemented by the core */
+int usb_statusStart(hcd_t *hcd);
+
+
+/* Waits for the status thread to handle remaining completions and exit */
+void usb_statusStop(hcd_t *hcd);
+
+
+/* Reserves periodic bandwidth of a full/low-speed pipe on its transaction translator.
+ * Returns 0 or -ENOSPC if the TT budget is exhausted. The allocation is stored in the pipe:
+ * first frame in ttFrame, repeated every ttPeriod frames, ttLoad is 0 if nothing was reserved */
+int hcd_ttReserve(usb_pipe_t *pipe);
+
 
-hcd_t *hcd_init(void);
+void hcd_ttRelease(usb_pipe_t *pipe);
 
 
 #endif
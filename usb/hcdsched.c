@@ -0,0 +1,353 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Controller transfer scheduler
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/list.h>
+#include <sys/minmax.h>
+
+#include "usbhost.h"
+#include "dev.h"
+#include "hcdsched.h"
+
+
+/* Period in frames, rounded down to a power of 2 fitting the frame list */
+static int hcdsched_period(hcdsched_t *s, usb_pipe_t *pipe)
+{
+	int interval = max(pipe->interval, 1);
+	int period = 1;
+
+	if (pipe->dev->speed == usb_high_speed)
+		interval = max((1 << min(interval - 1, 15)) / 8, 1);
+	else if (pipe->type == usb_transfer_isochronous)
+		interval = 1 << min(interval - 1, 15);
+
+	while (period * 2 <= interval && period * 2 <= s->frames)
+		period *= 2;
+
+	return period;
+}
+
+
+/* Bytes an endpoint moves per frame, wMaxPacketSize carries additional transactions in bits 11-12 */
+static int hcdsched_load(usb_pipe_t *pipe)
+{
+	int size = pipe->maxPacketLen & 0x7ff;
+	int mult = ((pipe->maxPacketLen >> 11) & 0x3) + 1;
+	int interval = max(pipe->interval, 1);
+
+	if (pipe->dev->speed != usb_high_speed)
+		return size;
+
+	/* Periods shorter than a frame are served in several microframes of each frame */
+	if (interval < 4)
+		return size * mult * (8 >> (interval - 1));
+
+	return size * mult;
+}
+
+
+static int hcdsched_slotAlloc(hcdsched_t *s, hcdsched_ep_t *ep)
+{
+	usb_pipe_t *pipe = ep->pipe;
+	int frame, f, load, first = 0, last, best = -1, bestLoad = 0;
+
+	ep->period = hcdsched_period(s, pipe);
+	ep->load = hcdsched_load(pipe);
+	last = ep->period - 1;
+
+	/* Split transactions go in the frames reserved on the transaction translator */
+	if (pipe->ttLoad != 0) {
+		ep->period = min(pipe->ttPeriod, (int)s->frames);
+		first = last = pipe->ttFrame % ep->period;
+	}
+
+	/* Least loaded phase the endpoint fits in */
+	for (frame = first; frame <= last; frame++) {
+		load = 0;
+		for (f = frame; f < s->frames; f += ep->period)
+			load = max(load, s->load[f]);
+
+		if (load + ep->load <= s->budget && (best < 0 || load < bestLoad)) {
+			best = frame;
+			bestLoad = load;
+		}
+	}
+
+	if (best < 0)
+		return -ENOSPC;
+
+	for (f = best; f < s->frames; f += ep->period)
+		s->load[f] += ep->load;
+	ep->phase = best;
+
+	return 0;
+}
+
+
+static void hcdsched_slotFree(hcdsched_t *s, hcdsched_ep_t *ep)
+{
+	int f;
+
+	for (f = ep->phase; f < s->frames; f += ep->period)
+		s->load[f] -= ep->load;
+}
+
+
+static int hcdsched_epGet(hcdsched_t *s, usb_pipe_t *pipe, hcdsched_ep_t **res)
+{
+	hcdsched_ep_t *ep;
+	int ret;
+
+	if ((*res = pipe->hcdpriv) != NULL)
+		return 0;
+
+	if ((ep = calloc(1, sizeof(*ep))) == NULL)
+		return -ENOMEM;
+
+	ep->pipe = pipe;
+	if ((pipe->type == usb_transfer_interrupt || pipe->type == usb_transfer_isochronous) && (ret = hcdsched_slotAlloc(s, ep)) != 0) {
+		free(ep);
+		return ret;
+	}
+
+	if (s->ops->epInit != NULL && (ret = s->ops->epInit(s, ep)) != 0) {
+		if (ep->period != 0)
+			hcdsched_slotFree(s, ep);
+		free(ep);
+		return ret;
+	}
+
+	pipe->hcdpriv = ep;
+	*res = ep;
+
+	return 0;
+}
+
+
+static void hcdsched_retire(hcdsched_ep_t *ep, usb_transfer_t *t, int status, usb_transfer_t **done)
+{
+	LIST_REMOVE(&ep->queue, t);
+
+	t->error = (status < 0) ? -status : 0;
+	t->transferred = (status < 0) ? 0 : status;
+	LIST_ADD(done, t);
+}
+
+
+/* Hands queued transfers to the hardware up to the endpoint depth */
+static void hcdsched_epFill(hcdsched_t *s, hcdsched_ep_t *ep, usb_transfer_t **done)
+{
+	usb_transfer_t *t;
+	int i, ret;
+
+	while (ep->nencoded < s->depth && ep->queue != NULL) {
+		for (i = 0, t = ep->queue; i < ep->nencoded; i++)
+			t = t->next;
+
+		/* Everything queued is in hardware already */
+		if (i > 0 && t == ep->queue)
+			break;
+
+		if ((ret = s->ops->encode(s, ep, t)) == 0)
+			ep->nencoded++;
+		else
+			hcdsched_retire(ep, t, ret, done);
+	}
+}
+
+
+static void hcdsched_epUpdate(hcdsched_t *s, hcdsched_ep_t *ep)
+{
+	if (ep->queue != NULL && !ep->listed) {
+		LIST_ADD(&s->active, ep);
+		ep->listed = 1;
+	}
+	else if (ep->queue == NULL && ep->listed) {
+		LIST_REMOVE(&s->active, ep);
+		ep->listed = 0;
+	}
+}
+
+
+int hcdsched_enqueue(hcdsched_t *s, usb_transfer_t *t)
+{
+	hcdsched_ep_t *ep;
+	int ret;
+
+	if ((ret = hcdsched_epGet(s, t->pipe, &ep)) != 0)
+		return ret;
+
+	LIST_ADD(&ep->queue, t);
+
+	/* Fills the endpoint right away, encoding errors are reported to the submitter */
+	if (ep->nencoded < s->depth) {
+		if ((ret = s->ops->encode(s, ep, t)) != 0) {
+			LIST_REMOVE(&ep->queue, t);
+			return ret;
+		}
+		ep->nencoded++;
+	}
+
+	hcdsched_epUpdate(s, ep);
+
+	return 0;
+}
+
+
+static int hcdsched_encoded(hcdsched_ep_t *ep, usb_transfer_t *t)
+{
+	usb_transfer_t *it = ep->queue;
+	int i;
+
+	for (i = 0; i < ep->nencoded; i++, it = it->next) {
+		if (it == t)
+			return 1;
+	}
+
+	return 0;
+}
+
+
+void hcdsched_dequeue(hcdsched_t *s, usb_transfer_t *t, usb_transfer_t **done)
+{
+	hcdsched_ep_t *ep = t->pipe->hcdpriv;
+	usb_transfer_t *it;
+
+	if (ep == NULL || (it = ep->queue) == NULL)
+		return;
+
+	/* Transfer may have completed already */
+	do {
+		if (it == t)
+			break;
+		it = it->next;
+	} while (it != ep->queue);
+
+	if (it != t)
+		return;
+
+	if (hcdsched_encoded(ep, t)) {
+		s->ops->cancel(s, ep, t);
+		ep->nencoded--;
+	}
+
+	hcdsched_retire(ep, t, -ECANCELED, done);
+	hcdsched_epFill(s, ep, done);
+	hcdsched_epUpdate(s, ep);
+}
+
+
+void hcdsched_pipeDestroy(hcdsched_t *s, usb_pipe_t *pipe, usb_transfer_t **done)
+{
+	hcdsched_ep_t *ep = pipe->hcdpriv;
+	usb_transfer_t *t;
+
+	if (ep == NULL)
+		return;
+
+	while ((t = ep->queue) != NULL) {
+		if (ep->nencoded > 0) {
+			s->ops->cancel(s, ep, t);
+			ep->nencoded--;
+		}
+		hcdsched_retire(ep, t, -ECANCELED, done);
+	}
+
+	hcdsched_epUpdate(s, ep);
+
+	if (s->ops->epDestroy != NULL)
+		s->ops->epDestroy(s, ep);
+
+	if (ep->period != 0)
+		hcdsched_slotFree(s, ep);
+
+	pipe->hcdpriv = NULL;
+	free(ep);
+}
+
+
+int hcdsched_scan(hcdsched_t *s, usb_transfer_t **done)
+{
+	hcdsched_ep_t *ep, *next;
+	usb_transfer_t *t;
+	int n = 0, status, last;
+
+	s->scans++;
+
+	if ((ep = s->active) == NULL)
+		return 0;
+
+	do {
+		next = ep->next;
+		last = (next == s->active);
+
+		/* Endpoints complete in order, the first transfer still in hardware ends the scan */
+		while (ep->nencoded > 0) {
+			t = ep->queue;
+			if ((status = s->ops->decode(s, ep, t)) == -EINPROGRESS)
+				break;
+
+			ep->nencoded--;
+			hcdsched_retire(ep, t, status, done);
+			n++;
+		}
+
+		hcdsched_epFill(s, ep, done);
+		hcdsched_epUpdate(s, ep);
+		ep = next;
+	} while (!last && s->active != NULL);
+
+	s->completed += n;
+
+	return n;
+}
+
+
+void hcdsched_complete(usb_transfer_t *done)
+{
+	usb_transfer_t *t;
+
+	while ((t = done) != NULL) {
+		LIST_REMOVE(&done, t);
+		usb_transferFinished(t, (t->error != 0) ? -t->error : (int)t->transferred);
+	}
+}
+
+
+int hcdsched_init(hcdsched_t *s, const hcdsched_ops_t *ops, void *priv, unsigned int frames, unsigned int budget, int depth)
+{
+	memset(s, 0, sizeof(*s));
+
+	/* Periods are powers of 2 repeating over the frame list */
+	if (frames == 0 || (frames & (frames - 1)) != 0)
+		return -EINVAL;
+
+	if ((s->load = calloc(frames, sizeof(*s->load))) == NULL)
+		return -ENOMEM;
+
+	s->ops = ops;
+	s->priv = priv;
+	s->frames = frames;
+	s->budget = budget;
+	s->depth = max(depth, 1);
+
+	return 0;
+}
+
+
+void hcdsched_destroy(hcdsched_t *s)
+{
+	free(s->load);
+	s->load = NULL;
+}
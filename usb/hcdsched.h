@@ -0,0 +1,105 @@
+/*
+ * Phoenix-RTOS
+ *
+ * USB Host Controller transfer scheduler
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+
+#ifndef _HCDSCHED_H_
+#define _HCDSCHED_H_
+
+#include "usbhost.h"
+
+/*
+ * Software part of transfer scheduling shared by hcd backends: per-endpoint
+ * transfer queues, periodic slot allocation and in-order completion scanning.
+ * Backends only translate transfers to and from their hardware descriptors.
+ *
+ * Scheduler functions are called with the backend lock held. Finished transfers
+ * are returned as a list to be passed to hcdsched_complete() once it is released.
+ */
+
+struct hcdsched;
+
+typedef struct hcdsched_ep {
+	struct hcdsched_ep *next, *prev;
+	usb_pipe_t *pipe;
+	usb_transfer_t *queue; /* Submission order, the first nencoded ones are in hardware */
+	int nencoded;
+	int listed;
+
+	/* Periodic slot, period 0 for asynchronous endpoints. Load in bytes per frame,
+	 * full/low-speed endpoints behind a TT are placed in the frames it reserved */
+	int period;
+	int phase;
+	int load;
+
+	void *priv; /* Backend endpoint descriptor */
+} hcdsched_ep_t;
+
+
+typedef struct {
+	/* Prepares the hardware descriptor of a transfer */
+	int (*encode)(struct hcdsched *, hcdsched_ep_t *, usb_transfer_t *);
+
+	/* Returns bytes transferred, a negative error or -EINPROGRESS while the hardware owns the transfer */
+	int (*decode)(struct hcdsched *, hcdsched_ep_t *, usb_transfer_t *);
+
+	/* Takes an encoded transfer back from the hardware */
+	void (*cancel)(struct hcdsched *, hcdsched_ep_t *, usb_transfer_t *);
+
+	/* Optional, called for a new endpoint and before it is freed */
+	int (*epInit)(struct hcdsched *, hcdsched_ep_t *);
+	void (*epDestroy)(struct hcdsched *, hcdsched_ep_t *);
+} hcdsched_ops_t;
+
+
+typedef struct hcdsched {
+	const hcdsched_ops_t *ops;
+	void *priv;
+
+	hcdsched_ep_t *active; /* Endpoints with queued transfers */
+	int depth;          /* Transfers encoded per endpoint at once */
+
+	unsigned int frames; /* Periodic frame list size, power of 2 */
+	unsigned int budget; /* Periodic bytes per frame */
+	unsigned int *load;
+
+	unsigned long long scans;
+	unsigned long long completed;
+} hcdsched_t;
+
+
+/* Frames has to be a nonzero power of 2, -EINVAL otherwise */
+int hcdsched_init(hcdsched_t *s, const hcdsched_ops_t *ops, void *priv, unsigned int frames, unsigned int budget, int depth);
+
+
+void hcdsched_destroy(hcdsched_t *s);
+
+
+/* Queues a transfer on its pipe endpoint, -ENOSPC if a new periodic endpoint does not fit */
+int hcdsched_enqueue(hcdsched_t *s, usb_transfer_t *t);
+
+
+void hcdsched_dequeue(hcdsched_t *s, usb_transfer_t *t, usb_transfer_t **done);
+
+
+/* Cancels all transfers of a pipe and releases its endpoint */
+void hcdsched_pipeDestroy(hcdsched_t *s, usb_pipe_t *pipe, usb_transfer_t **done);
+
+
+/* Collects finished transfers of all active endpoints, returns their number */
+int hcdsched_scan(hcdsched_t *s, usb_transfer_t **done);
+
+
+/* Reports finished transfers, called without the backend lock */
+void hcdsched_complete(usb_transfer_t *done);
+
+
+#endif
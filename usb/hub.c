@@ -35,21 +35,92 @@
 
 #define HUB_ENUM_RETRIES     3
 #define HUB_DEBOUNCE_STABLE  100000
-#define HUB_DEBOUNCE_PERIOD  25000
 #define HUB_DEBOUNCE_TIMEOUT 1500000
-
-
-typedef struct _hub_event {
-	struct _hub_event *next, *prev;
+#define HUB_RESET_POLL       10000
+#define HUB_RESET_TIMEOUT    500000
+#define HUB_RESET_RECOVERY   10000
+#define HUB_RESET_WAIT       10000
+#define HUB_NWORKERS         3
+#define HUB_WORKER_PRIO      4
+#define HUB_ERR_WINDOW       10000000
+#define HUB_ERR_MAX          8
+#define HUB_BACKOFF_MIN      50000
+#define HUB_BACKOFF_MAX      5000000
+#define HUB_DISABLE_RETRY    30000000
+#define HUB_DIAG_EVENTS      8
+#define HUB_STATUS_RETRY     100000
+#define HUB_AUTOSUSPEND_DELAY 2000000
+#define HUB_RESUME_POLL       2000
+#define HUB_RESUME_TIMEOUT    100000
+#define HUB_RESUME_RECOVERY   10000
+#define HUB_RESUME_BOUND      40000
+
+
+enum { hub_port_idle, hub_port_debounce, hub_port_resetWait, hub_port_reset, hub_port_recovery, hub_port_backoff,
+	hub_port_disabled, hub_port_suspended, hub_port_resume, hub_port_power };
+
+
+typedef struct _hub_port {
+	struct _hub_port *next, *prev;
 	usb_dev_t *hub;
-} hub_event_t;
+	usb_dev_t *dev; /* Device being enumerated */
+	int num;
+
+	/* Scheduling, protected by hub_common.lock */
+	int queued;
+	int armed;
+	int busy;
+	int pending;
+	time_t deadline;
+
+	/* State machine, owned by the worker running the port */
+	int state;
+	int retries;
+	uint16_t connection;
+	time_t debounceStart;
+	time_t stableSince;
+	time_t resetStart;
+
+	/* Hot-plug storm protection */
+	int errors;
+	time_t errStart;
+	time_t changeTime;
+	time_t backoffEnd;
+	unsigned int flaps;
+	unsigned int failures;
+
+	/* Selective suspend */
+	int resumeReq;
+	time_t resumeStart;
+	time_t resumeEnd;
+} hub_port_t;
 
 
 struct {
-	char stack[4096] __attribute__((aligned(8)));
+	char stack[HUB_NWORKERS][4096] __attribute__((aligned(8)));
 	handle_t lock;
 	handle_t cond;
-	hub_event_t *events;
+	handle_t doneCond;
+	usb_dev_t *events;
+	hub_port_t *ports;
+	hub_port_t *timers;
+	usb_dev_t *statusTimers; /* Hubs waiting to retry their status transfer */
+
+	/* Diagnostics, protected by lock */
+	struct {
+		uint64_t locationID;
+		int port;
+		int errors;
+		time_t time;
+	} diag[HUB_DIAG_EVENTS];
+	unsigned int ndiag;
+	unsigned int flaps;
+	unsigned int failures;
+	unsigned int disabled;
+	unsigned int suspends;
+	unsigned int resumes;
+	time_t resumeLast;
+	time_t resumeMax;
 } hub_common;
 
 
@@ -81,20 +152,45 @@ static int hub_setConf(usb_dev_t *hub, int conf)
 }
 
 
-static int hub_setPortPower(usb_dev_t *hub, int port)
+static int hub_setInterface(usb_dev_t *hub, int iface, int alt)
 {
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
-		.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_CLASS | REQUEST_RECIPIENT_OTHER,
-		.bRequest = REQ_SET_FEATURE,
-		.wValue = USB_PORT_FEAT_POWER,
-		.wIndex = port,
-		.wLength = 0
+		.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_STANDARD | REQUEST_RECIPIENT_INTERFACE,
+		.bRequest = REQ_SET_INTERFACE,
+		.wValue = alt,
+		.wIndex = iface,
+		.wLength = 0,
 	};
 
 	return usb_devCtrl(hub, usb_dir_out, &setup, NULL, 0);
 }
 
 
+static int hub_setPortsPower(usb_dev_t *hub)
+{
+	usb_setup_packet_t *setups;
+	int i, ret;
+
+	if ((setups = malloc(hub->nports * sizeof(usb_setup_packet_t))) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < hub->nports; i++) {
+		setups[i] = (usb_setup_packet_t) {
+			.bmRequestType = REQUEST_DIR_HOST2DEV | REQUEST_TYPE_CLASS | REQUEST_RECIPIENT_OTHER,
+			.bRequest = REQ_SET_FEATURE,
+			.wValue = USB_PORT_FEAT_POWER,
+			.wIndex = i + 1,
+			.wLength = 0
+		};
+	}
+
+	ret = usb_devCtrlBatch(hub, usb_dir_out, setups, NULL, 0, hub->nports);
+	free(setups);
+
+	return ret;
+}
+
+
 static int hub_getPortStatus(usb_dev_t *hub, int port, usb_port_status_t *status)
 {
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
@@ -109,6 +205,31 @@ static int hub_getPortStatus(usb_dev_t *hub, int port, usb_port_status_t *status
 }
 
 
+static int hub_getPortsStatus(usb_dev_t *hub, usb_port_status_t *status)
+{
+	usb_setup_packet_t *setups;
+	int i, ret;
+
+	if ((setups = malloc(hub->nports * sizeof(usb_setup_packet_t))) == NULL)
+		return -ENOMEM;
+
+	for (i = 0; i < hub->nports; i++) {
+		setups[i] = (usb_setup_packet_t) {
+			.bmRequestType = REQUEST_DIR_DEV2HOST | REQUEST_TYPE_CLASS | REQUEST_RECIPIENT_OTHER,
+			.bRequest = REQ_GET_STATUS,
+			.wValue = 0,
+			.wIndex = i + 1,
+			.wLength = sizeof(usb_port_status_t)
+		};
+	}
+
+	ret = usb_devCtrlBatch(hub, usb_dir_in, setups, (char *)status, sizeof(usb_port_status_t), hub->nports);
+	free(setups);
+
+	return ret;
+}
+
+
 static int hub_clearPortFeature(usb_dev_t *hub, int port, uint16_t wValue)
 {
 	usb_setup_packet_t setup = (usb_setup_packet_t) {
@@ -137,42 +258,74 @@ static int hub_setPortFeature(usb_dev_t *hub, int port, uint16_t wValue)
 }
 
 
+static void hub_interruptFree(usb_transfer_t *t)
+{
+	int i;
+
+	for (i = 0; i < 2; i++)
+		usb_freeDma(t[i].buffer, t[i].size, t[i].bufAlign);
+	free(t);
+}
+
+
 static int hub_interruptInit(usb_dev_t *hub)
 {
 	usb_transfer_t *t;
+	size_t size = (hub->nports / 8) + 1;
+	int i;
 
-	if ((t = calloc(1, sizeof(usb_transfer_t))) == NULL) {
+	/* Double buffered, one transfer is always armed while the other one is consumed */
+	if ((t = calloc(2, sizeof(usb_transfer_t))) == NULL) {
 		USB_LOG("hub: Out of memory!\n");
 		return -ENOMEM;
 	}
 
-	if ((t->buffer = usb_alloc(sizeof(uint32_t))) == NULL) {
-		free(t);
+	for (i = 0; i < 2; i++) {
+		t[i].type = usb_transfer_interrupt;
+		t[i].direction = usb_dir_in;
+		t[i].size = size;
+		t[i].bufAlign = hub->hcd->caps.dmaAlign;
+		t[i].hub = hub;
+
+		if ((t[i].buffer = usb_allocDma(size, t[i].bufAlign)) == NULL) {
+			hub_interruptFree(t);
+			USB_LOG("hub: Out of memory!\n");
+			return -ENOMEM;
+		}
+	}
+
+	if ((hub->changes = calloc(1, size)) == NULL) {
+		hub_interruptFree(t);
 		USB_LOG("hub: Out of memory!\n");
 		return -ENOMEM;
 	}
 
 	if ((hub->irqPipe = usb_pipeOpen(hub, 0, usb_dir_in, usb_transfer_interrupt)) == NULL) {
-		usb_free(t->buffer, sizeof(uint32_t));
-		free(t);
+		hub_interruptFree(t);
+		free(hub->changes);
+		hub->changes = NULL;
 		USB_LOG("hub: Fail to open interrupt pipe!\n");
 		return -ENOMEM;
 	}
 
-	t->type = usb_transfer_interrupt;
-	t->direction = usb_dir_in;
-	t->size = (hub->nports / 8) + 1;
-	t->hub = hub;
-
 	hub->statusTransfer = t;
 
 	return 0;
 }
 
 
+void hub_statusFree(usb_dev_t *hub)
+{
+	if (hub->statusTransfer != NULL) {
+		hub_interruptFree(hub->statusTransfer);
+		hub->statusTransfer = NULL;
+	}
+}
+
+
 static int hub_poll(usb_dev_t *hub)
 {
-	return usb_transferSubmit(hub->statusTransfer, hub->irqPipe, NULL);
+	return usb_transferSubmit(&hub->statusTransfer[0], hub->irqPipe, NULL);
 }
 
 
@@ -191,252 +344,1149 @@ static int hub_clearPortFeatures(usb_dev_t *hub, int port, uint32_t change)
 }
 
 
-int hub_portReset(usb_dev_t *hub, int port, usb_port_status_t *status)
+static void _hub_portTimerCancel(hub_port_t *port)
 {
-	int retries;
+	if (port->armed) {
+		LIST_REMOVE(&hub_common.timers, port);
+		port->armed = 0;
+	}
+}
 
-	memset(status, 0, sizeof(*status));
-	if (hub_setPortFeature(hub, port, USB_PORT_FEAT_RESET) < 0)
-		return -1;
 
-	for (retries = 5; (status->wPortChange & USB_PORT_STAT_C_RESET) == 0 && retries > 0; --retries) {
-		usleep(100000);
-		if (hub_getPortStatus(hub, port, status) < 0)
-			return -1;
+static void _hub_portQueue(hub_port_t *port)
+{
+	if (port->busy) {
+		/* Rerun once the current worker is done with it */
+		port->pending = 1;
+	}
+	else if (!port->queued) {
+		/* Status change reported by the hub overrides a waiting timer */
+		_hub_portTimerCancel(port);
+		port->queued = 1;
+		LIST_ADD(&hub_common.ports, port);
+		condSignal(hub_common.cond);
 	}
+}
 
-	if (hub_clearPortFeatures(hub, port, status->wPortChange) < 0)
-		return -1;
 
-	return (retries > 0) ? 0 : -1;
+static void _hub_eventQueue(usb_dev_t *hub)
+{
+	/* Already queued hub picks up the new bits on its wakeup */
+	if (!hub->evPending) {
+		hub->evPending = 1;
+		LIST_ADD(&hub_common.events, hub);
+		condSignal(hub_common.cond);
+	}
 }
 
 
-static int hub_portDebounce(usb_dev_t *hub, int port)
+static void _hub_statusTimerCancel(usb_dev_t *hub)
 {
-	usb_port_status_t status;
-	uint16_t pstatus = 0xffff;
-	int totalTime = 0, stableTime = 0;
-	int ret;
+	if (hub->statusRetry != 0) {
+		LIST_REMOVE_EX(&hub_common.statusTimers, hub, tnext, tprev);
+		hub->statusRetry = 0;
+	}
+}
 
-	while (totalTime < HUB_DEBOUNCE_TIMEOUT) {
-		if ((ret = hub_getPortStatus(hub, port, &status)) < 0)
-			return ret;
 
-		if (!(status.wPortChange & USB_PORT_STAT_C_CONNECTION) &&
-				(status.wPortStatus & USB_PORT_STAT_CONNECTION) == pstatus) {
-			stableTime += HUB_DEBOUNCE_PERIOD;
-			if (stableTime >= HUB_DEBOUNCE_STABLE)
-				break;
-		}
-		else {
-			stableTime = 0;
-			pstatus = status.wPortStatus & USB_PORT_STAT_CONNECTION;
+/* Status transfer failed, it is re-armed from a worker after a backoff */
+static void _hub_statusRetry(usb_dev_t *hub, usb_transfer_t *t)
+{
+	time_t now;
+
+	gettime(&now, NULL);
+	hub->statusRearm = t;
+	hub->statusErrors++;
+
+	_hub_statusTimerCancel(hub);
+	hub->statusRetry = now + min((time_t)hub->statusErrors * HUB_STATUS_RETRY, (time_t)HUB_BACKOFF_MAX);
+	LIST_ADD_EX(&hub_common.statusTimers, hub, tnext, tprev);
+	condSignal(hub_common.cond);
+}
+
+
+static time_t _hub_timersExpire(time_t now)
+{
+	hub_port_t *port, *next;
+	usb_dev_t *hub, *hnext;
+	time_t timeout = 0;
+	int i, n = 0;
+
+	if ((hub = hub_common.statusTimers) != NULL) {
+		do {
+			n++;
+			hub = hub->tnext;
+		} while (hub != hub_common.statusTimers);
+
+		for (i = 0; i < n; i++) {
+			hnext = hub->tnext;
+			if (hub->statusRetry <= now) {
+				_hub_statusTimerCancel(hub);
+				_hub_eventQueue(hub);
+			}
+			else if (timeout == 0 || hub->statusRetry - now < timeout) {
+				timeout = hub->statusRetry - now;
+			}
+			hub = hnext;
 		}
+	}
 
-		if (status.wPortChange & USB_PORT_STAT_C_CONNECTION)
-			hub_clearPortFeature(hub, port, USB_PORT_FEAT_C_CONNECTION);
+	if ((port = hub_common.timers) == NULL)
+		return timeout;
 
-		totalTime += HUB_DEBOUNCE_PERIOD;
-		usleep(HUB_DEBOUNCE_PERIOD);
+	n = 0;
+	do {
+		n++;
+		port = port->next;
+	} while (port != hub_common.timers);
+
+	for (i = 0; i < n; i++) {
+		next = port->next;
+		if (port->deadline <= now)
+			_hub_portQueue(port);
+		else if (timeout == 0 || port->deadline - now < timeout)
+			timeout = port->deadline - now;
+		port = next;
 	}
 
-	if (stableTime < HUB_DEBOUNCE_STABLE)
-		return -ETIMEDOUT;
+	return timeout;
+}
+
+
+static void hub_portTimer(hub_port_t *port, time_t deadline)
+{
+	port->deadline = deadline;
+}
+
+
+static int hub_enumAcquire(hub_port_t *port)
+{
+	hcd_t *hcd = port->hub->hcd;
+	int ret = 0;
+
+	mutexLock(hub_common.lock);
+	if (hcd->enumOwner == NULL || hcd->enumOwner == port)
+		hcd->enumOwner = port;
+	else
+		ret = -EBUSY;
+	mutexUnlock(hub_common.lock);
 
-	return pstatus;
+	return ret;
 }
 
 
-static void hub_devConnected(usb_dev_t *hub, int port)
+static void hub_enumRelease(hub_port_t *port)
 {
-	usb_dev_t *dev;
-	usb_port_status_t status;
-	int ret;
-	int retries = HUB_ENUM_RETRIES;
+	hcd_t *hcd = port->hub->hcd;
+
+	mutexLock(hub_common.lock);
+	if (hcd->enumOwner == port)
+		hcd->enumOwner = NULL;
+	mutexUnlock(hub_common.lock);
+}
+
+
+static void hub_portDebounceStart(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	port->state = hub_port_debounce;
+	port->debounceStart = now;
+	port->stableSince = now;
+	port->connection = status->wPortStatus & USB_PORT_STAT_CONNECTION;
+	hub_portTimer(port, now + HUB_DEBOUNCE_STABLE);
+}
+
+
+static void hub_portIdle(hub_port_t *port)
+{
+	hub_enumRelease(port);
+	port->state = hub_port_idle;
+
+	/* Enumeration abandoned */
+	if (port->dev != NULL) {
+		usb_devDisconnected(port->dev);
+		port->dev = NULL;
+	}
+}
+
+
+static void hub_portDisable(hub_port_t *port, time_t now)
+{
+	usb_dev_t *hub = port->hub;
+	int i;
+
+	USB_LOG("hub: Port %d of hub %016llx disabled after %d errors\n", port->num, (unsigned long long)hub->locationID, port->errors);
+
+	mutexLock(hub_common.lock);
+	i = hub_common.ndiag++ % HUB_DIAG_EVENTS;
+	hub_common.diag[i].locationID = hub->locationID;
+	hub_common.diag[i].port = port->num;
+	hub_common.diag[i].errors = port->errors;
+	hub_common.diag[i].time = now;
+	hub_common.disabled++;
+	mutexUnlock(hub_common.lock);
+
+	hub_portIdle(port);
+	if (hub->devs[port->num - 1] != NULL)
+		usb_devDisconnected(hub->devs[port->num - 1]);
+
+	/* Powered off port stops reporting changes, it is powered on again after a while */
+	hub_clearPortFeature(hub, port->num, USB_PORT_FEAT_POWER);
+	port->state = hub_port_disabled;
+	port->backoffEnd = now + HUB_DISABLE_RETRY;
+	hub_portTimer(port, port->backoffEnd);
+}
+
+
+/* Returns delay before the port may be handled again, -1 if it got disabled */
+static time_t hub_portError(hub_port_t *port, time_t now)
+{
+	if (now - port->errStart > HUB_ERR_WINDOW) {
+		port->errStart = now;
+		port->errors = 0;
+	}
+
+	if (++port->errors >= HUB_ERR_MAX) {
+		hub_portDisable(port, now);
+		return -1;
+	}
+
+	return (port->errors > 1) ? min(HUB_BACKOFF_MIN << (port->errors - 2), HUB_BACKOFF_MAX) : 0;
+}
+
 
-	if ((dev = usb_devAlloc()) == NULL) {
-		USB_LOG("hub: Not enough memory to allocate a new device!\n");
+static void hub_portBackoff(hub_port_t *port, usb_port_status_t *status, time_t now, time_t delay)
+{
+	if (delay == 0) {
+		hub_portDebounceStart(port, status, now);
 		return;
 	}
 
-	dev->hub = hub;
-	dev->hcd = hub->hcd;
-	dev->port = port;
+	port->state = hub_port_backoff;
+	port->backoffEnd = now + delay;
+	hub_portTimer(port, port->backoffEnd);
+}
 
-	do {
-		if ((ret = hub_portReset(hub, port, &status)) < 0) {
-			USB_LOG("hub: fail to reset port %d\n", port);
-			break;
-		}
 
-		if (status.wPortStatus & USB_PORT_STAT_HIGH_SPEED)
-			dev->speed = usb_high_speed;
-		else if (status.wPortStatus & USB_PORT_STAT_LOW_SPEED)
-			dev->speed = usb_low_speed;
+/* Connection changed again before the previous change settled */
+static void hub_portFlap(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	time_t delay;
+
+	port->flaps++;
+	mutexLock(hub_common.lock);
+	hub_common.flaps++;
+	mutexUnlock(hub_common.lock);
+
+	/* A flapping port gets exponentially less of the workers' time */
+	if ((delay = hub_portError(port, now)) < 0)
+		return;
+
+	port->retries = HUB_ENUM_RETRIES;
+	hub_portBackoff(port, status, now, delay);
+}
+
+
+static void hub_portFail(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	usb_dev_t *dev = port->dev;
+	time_t delay;
+
+	hub_enumRelease(port);
+
+	port->failures++;
+	mutexLock(hub_common.lock);
+	hub_common.failures++;
+	mutexUnlock(hub_common.lock);
+
+	if ((delay = hub_portError(port, now)) < 0)
+		return;
+
+	if (--port->retries <= 0 || !(status->wPortStatus & USB_PORT_STAT_CONNECTION)) {
+		printf("usb: Enumeration failed. No retrying\n");
+		hub_portIdle(port);
+		return;
+	}
+
+	printf("usb: Enumeration failed retries left: %d\n", port->retries);
+	if (dev != NULL) {
+		if (port->hub->devs[port->num - 1] == dev)
+			usb_devSetChild(port->hub, port->num, NULL);
+		dev->hcd->ops->pipeDestroy(dev->hcd, dev->ctrlPipe);
+		if (dev->address != 0)
+			hcd_addrFree(dev->hcd, dev->address);
+		dev->address = 0;
+		dev->locationID = 0;
+	}
+
+	hub_portBackoff(port, status, now, delay);
+}
+
+
+static void hub_portResetStart(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	/* Only one device on the bus may respond at the default address */
+	if (hub_enumAcquire(port) < 0) {
+		port->state = hub_port_resetWait;
+		hub_portTimer(port, now + HUB_RESET_WAIT);
+		return;
+	}
+
+	if (hub_setPortFeature(port->hub, port->num, USB_PORT_FEAT_RESET) < 0) {
+		USB_LOG("hub: fail to reset port %d\n", port->num);
+		hub_portFail(port, status, now);
+		return;
+	}
+
+	port->state = hub_port_reset;
+	port->resetStart = now;
+	hub_portTimer(port, now + HUB_RESET_POLL);
+}
+
+
+static void hub_devTT(usb_dev_t *hub, usb_dev_t *dev, int port)
+{
+	if (dev->speed == usb_high_speed) {
+		dev->tt = NULL;
+		dev->ttPort = 0;
+	}
+	else if (hub->ntts > 0) {
+		/* First high-speed hub upstream translates for this device */
+		dev->tt = &hub->tts[(hub->ntts > 1) ? port - 1 : 0];
+		dev->ttPort = port;
+	}
+	else {
+		dev->tt = hub->tt;
+		dev->ttPort = hub->ttPort;
+	}
+}
+
+
+static int hub_ttInit(usb_dev_t *hub, usb_hub_desc_t *desc)
+{
+	int i, multi = 0;
+
+	if (hub->speed != usb_high_speed)
+		return 0;
+
+	/* Multi-TT hubs run with a single TT until alternate setting 1 is selected */
+	if (hub->desc.bDeviceProtocol == USB_HUB_PROTO_MULTI_TT && hub_setInterface(hub, 0, 1) >= 0)
+		multi = 1;
+
+	hub->ntts = multi ? hub->nports : 1;
+	if ((hub->tts = calloc(hub->ntts, sizeof(usb_tt_t))) == NULL) {
+		hub->ntts = 0;
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < hub->ntts; i++) {
+		hub->tts[i].hub = hub;
+		hub->tts[i].port = multi ? i + 1 : 0;
+		hub->tts[i].multi = multi;
+		hub->tts[i].thinkTime = USB_HUB_TT_THINK_TIME(desc->wHubCharacteristics);
+	}
+
+	return 0;
+}
+
+
+static void hub_portAutosuspend(hub_port_t *port, time_t now)
+{
+	usb_dev_t *dev = port->hub->devs[port->num - 1];
+	time_t deadline;
+
+	/* Hubs keep their status transfer queued, there is no remote wakeup support */
+	if (dev == NULL || dev->ports != NULL)
+		return;
+
+	mutexLock(hub_common.lock);
+	port->resumeReq = 0;
+	mutexUnlock(hub_common.lock);
+
+	if ((deadline = usb_devPmSuspend(dev, now, HUB_AUTOSUSPEND_DELAY)) != 0) {
+		/* With transfers in flight the timer is re-armed once the device goes idle */
+		if (deadline > 0)
+			hub_portTimer(port, deadline);
+		return;
+	}
+
+	if (hub_setPortFeature(port->hub, port->num, USB_PORT_FEAT_SUSPEND) < 0) {
+		usb_devPmResumed(dev, 0);
+		return;
+	}
+
+	port->state = hub_port_suspended;
+
+	mutexLock(hub_common.lock);
+	hub_common.suspends++;
+	mutexUnlock(hub_common.lock);
+}
+
+
+static void hub_portStatusIdle(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	usb_dev_t *hub = port->hub;
+	int connection = 0, flap;
+
+	if (status->wPortChange & USB_PORT_STAT_C_CONNECTION) {
+		hub_clearPortFeature(hub, port->num, USB_PORT_FEAT_C_CONNECTION);
+		connection = 1;
+	}
+
+	if (status->wPortChange & USB_PORT_STAT_C_ENABLE) {
+		hub_clearPortFeature(hub, port->num, USB_PORT_FEAT_C_ENABLE);
+		if (!(status->wPortStatus & USB_PORT_STAT_ENABLE))
+			connection = 1;
+	}
+
+	if (status->wPortChange & USB_PORT_STAT_C_RESET)
+		hub_clearPortFeature(hub, port->num, USB_PORT_FEAT_C_RESET);
+
+	if (status->wPortChange & USB_PORT_STAT_C_SUSPEND)
+		hub_clearPortFeature(hub, port->num, USB_PORT_FEAT_C_SUSPEND);
+
+	if (!connection) {
+		hub_portAutosuspend(port, now);
+		return;
+	}
+
+	if (hub->devs[port->num - 1] != NULL)
+		usb_devDisconnected(hub->devs[port->num - 1]);
+
+	/* Ordinary replug is not an error, only changes following each other closely are */
+	flap = (port->changeTime != 0 && now - port->changeTime < HUB_DEBOUNCE_TIMEOUT);
+	port->changeTime = now;
+
+	if (flap) {
+		hub_portFlap(port, status, now);
+		return;
+	}
+
+	port->retries = HUB_ENUM_RETRIES;
+	hub_portDebounceStart(port, status, now);
+}
+
+
+static void hub_portStatusBackoff(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	/* Changes during backoff are dropped, the port is resampled once it ends */
+	hub_clearPortFeatures(port->hub, port->num, status->wPortChange);
+
+	if (now < port->backoffEnd)
+		hub_portTimer(port, port->backoffEnd);
+	else
+		hub_portDebounceStart(port, status, now);
+}
+
+
+static void hub_portResumeDone(hub_port_t *port, int err, time_t now)
+{
+	usb_dev_t *dev = port->hub->devs[port->num - 1];
+	time_t latency = now - port->resumeStart;
+
+	port->state = hub_port_idle;
+	if (dev != NULL)
+		usb_devPmResumed(dev, err);
+
+	if (err != 0) {
+		USB_LOG("hub: Fail to resume port %d\n", port->num);
+		return;
+	}
+
+	mutexLock(hub_common.lock);
+	hub_common.resumes++;
+	hub_common.resumeLast = latency;
+	hub_common.resumeMax = max(hub_common.resumeMax, latency);
+	mutexUnlock(hub_common.lock);
+
+	if (latency > HUB_RESUME_BOUND)
+		USB_LOG("hub: Port %d resume took %lld us\n", port->num, (long long)latency);
+}
+
+
+static void hub_portStatusSuspended(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	usb_dev_t *dev = port->hub->devs[port->num - 1];
+	int resume;
+
+	/* Disconnected while suspended */
+	if (dev == NULL || (status->wPortChange & (USB_PORT_STAT_C_CONNECTION | USB_PORT_STAT_C_ENABLE))) {
+		port->state = hub_port_idle;
+		hub_portStatusIdle(port, status, now);
+		return;
+	}
+
+	mutexLock(hub_common.lock);
+	resume = port->resumeReq;
+	port->resumeReq = 0;
+	mutexUnlock(hub_common.lock);
+
+	if (!resume && (status->wPortStatus & USB_PORT_STAT_SUSPEND))
+		return;
+
+	port->state = hub_port_resume;
+	port->resumeStart = now;
+	port->resumeEnd = 0;
+
+	/* Remote wakeup leaves the port already resumed */
+	if ((status->wPortStatus & USB_PORT_STAT_SUSPEND) && hub_clearPortFeature(port->hub, port->num, USB_PORT_FEAT_SUSPEND) < 0) {
+		hub_portResumeDone(port, -EIO, now);
+		return;
+	}
+
+	/* Hub drives the resume signalling and reports its end with C_SUSPEND */
+	hub_portTimer(port, now + HUB_RESUME_POLL);
+}
+
+
+static void hub_portStatusResume(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	if (status->wPortChange & USB_PORT_STAT_C_SUSPEND)
+		hub_clearPortFeature(port->hub, port->num, USB_PORT_FEAT_C_SUSPEND);
+
+	if (!(status->wPortStatus & USB_PORT_STAT_CONNECTION)) {
+		hub_portResumeDone(port, -ENODEV, now);
+		hub_portStatusIdle(port, status, now);
+		return;
+	}
+
+	if (status->wPortStatus & USB_PORT_STAT_SUSPEND) {
+		if (now - port->resumeStart >= HUB_RESUME_TIMEOUT)
+			hub_portResumeDone(port, -ETIMEDOUT, now);
 		else
-			dev->speed = usb_full_speed;
+			hub_portTimer(port, now + HUB_RESUME_POLL);
+		return;
+	}
 
-		ret = usb_devEnumerate(dev);
-		retries--;
-		if (ret != 0 && !hub_portDebounce(hub, port)) {
-			printf("usb: Enumeration failed. No retrying\n");
-			break;
+	/* Resume recovery time before the device is accessed again */
+	if (port->resumeEnd == 0)
+		port->resumeEnd = now + HUB_RESUME_RECOVERY;
+
+	if (now < port->resumeEnd)
+		hub_portTimer(port, port->resumeEnd);
+	else
+		hub_portResumeDone(port, 0, now);
+}
+
+
+static void hub_portStatusDebounce(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	if ((status->wPortChange & USB_PORT_STAT_C_CONNECTION) ||
+			(status->wPortStatus & USB_PORT_STAT_CONNECTION) != port->connection) {
+		port->stableSince = now;
+		port->connection = status->wPortStatus & USB_PORT_STAT_CONNECTION;
+	}
+
+	if (status->wPortChange & USB_PORT_STAT_C_CONNECTION)
+		hub_clearPortFeature(port->hub, port->num, USB_PORT_FEAT_C_CONNECTION);
+
+	if (now - port->stableSince >= HUB_DEBOUNCE_STABLE) {
+		if (port->connection)
+			hub_portResetStart(port, status, now);
+		else
+			hub_portIdle(port);
+	}
+	else if (now - port->debounceStart >= HUB_DEBOUNCE_TIMEOUT) {
+		/* Never settled */
+		hub_portFlap(port, status, now);
+	}
+	else {
+		/* Further bouncing is reported by the hub and wakes the port earlier */
+		hub_portTimer(port, port->stableSince + HUB_DEBOUNCE_STABLE);
+	}
+}
+
+
+static void hub_portStatusReset(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	if (!(status->wPortChange & USB_PORT_STAT_C_RESET)) {
+		if (now - port->resetStart >= HUB_RESET_TIMEOUT) {
+			USB_LOG("hub: fail to reset port %d\n", port->num);
+			hub_portFail(port, status, now);
 		}
-		else if (ret != 0) {
-			printf("usb: Enumeration failed retries left: %d\n", retries);
-			dev->hcd->ops->pipeDestroy(dev->hcd, dev->ctrlPipe);
-			if (dev->address != 0)
-				hcd_addrFree(hub->hcd, dev->address);
-			dev->address = 0;
-			dev->locationID = 0;
+		else {
+			hub_portTimer(port, now + HUB_RESET_POLL);
+		}
+		return;
+	}
+
+	if (hub_clearPortFeatures(port->hub, port->num, status->wPortChange) < 0 ||
+			!(status->wPortStatus & USB_PORT_STAT_CONNECTION)) {
+		hub_portFail(port, status, now);
+		return;
+	}
+
+	if (port->dev == NULL) {
+		if ((port->dev = usb_devAlloc()) == NULL) {
+			USB_LOG("hub: Not enough memory to allocate a new device!\n");
+			hub_portIdle(port);
+			return;
 		}
-	} while (ret != 0 && retries > 0);
 
-	if (ret != 0)
-		usb_devDisconnected(dev);
+		port->dev->hub = port->hub;
+		port->dev->hcd = port->hub->hcd;
+		port->dev->port = port->num;
+		hcd_get(port->dev->hcd);
+	}
+
+	if (status->wPortStatus & USB_PORT_STAT_HIGH_SPEED)
+		port->dev->speed = usb_high_speed;
+	else if (status->wPortStatus & USB_PORT_STAT_LOW_SPEED)
+		port->dev->speed = usb_low_speed;
+	else
+		port->dev->speed = usb_full_speed;
+
+	hub_devTT(port->hub, port->dev, port->num);
+
+	/* Give the device its reset recovery time before addressing it */
+	port->state = hub_port_recovery;
+	port->resetStart = now;
+	hub_portTimer(port, now + HUB_RESET_RECOVERY);
 }
 
 
-static void hub_connectstatus(usb_dev_t *hub, int port, usb_port_status_t *status)
+static void hub_portStatusRecovery(hub_port_t *port, usb_port_status_t *status, time_t now)
 {
-	int pstatus;
+	usb_dev_t *dev = port->dev;
+	int ret;
 
-	if (hub->devs[port - 1] != NULL)
-		usb_devDisconnected(hub->devs[port - 1]);
+	if (now - port->resetStart < HUB_RESET_RECOVERY) {
+		hub_portTimer(port, port->resetStart + HUB_RESET_RECOVERY);
+		return;
+	}
 
-	if ((pstatus = hub_portDebounce(hub, port)) < 0)
+	if (!(status->wPortStatus & USB_PORT_STAT_CONNECTION)) {
+		hub_portFail(port, status, now);
 		return;
+	}
+
+	ret = usb_devAddress(dev);
+	hub_enumRelease(port);
+
+	if (ret == 0)
+		ret = usb_devEnumerate(dev);
+
+	if (ret != 0) {
+		hub_portFail(port, status, now);
+		return;
+	}
 
-	if (pstatus)
-		hub_devConnected(hub, port);
+	/* Device is now owned by the hub tree */
+	port->dev = NULL;
+	port->state = hub_port_idle;
+	hub_portTimer(port, now + HUB_AUTOSUSPEND_DELAY);
 }
 
 
-static void hub_portstatus(usb_dev_t *hub, int port)
+static void hub_portStatusDisabled(hub_port_t *port, usb_port_status_t *status, time_t now)
 {
-	usb_port_status_t status;
-	int connection = 0;
+	hub_clearPortFeatures(port->hub, port->num, status->wPortChange);
 
-	if (hub_getPortStatus(hub, port, &status) < 0)
+	if (now < port->backoffEnd) {
+		hub_portTimer(port, port->backoffEnd);
 		return;
+	}
 
-	if (status.wPortChange & USB_PORT_STAT_C_CONNECTION) {
-		hub_clearPortFeature(hub, port, USB_PORT_FEAT_C_CONNECTION);
-		connection = 1;
+	if (hub_setPortFeature(port->hub, port->num, USB_PORT_FEAT_POWER) < 0) {
+		port->backoffEnd = now + HUB_DISABLE_RETRY;
+		hub_portTimer(port, port->backoffEnd);
+		return;
 	}
 
-	if (status.wPortChange & USB_PORT_STAT_C_ENABLE) {
-		hub_clearPortFeature(hub, port, USB_PORT_FEAT_C_ENABLE);
-		if (!(status.wPortStatus & USB_PORT_STAT_ENABLE))
-			connection = 1;
+	USB_LOG("hub: Port %d of hub %016llx enabled again\n", port->num, (unsigned long long)port->hub->locationID);
+
+	/* Fresh error history, the port is resampled once its power is good */
+	port->errors = 0;
+	port->errStart = now;
+	port->changeTime = 0;
+	port->state = hub_port_power;
+	port->backoffEnd = now + port->hub->pwrGood;
+	hub_portTimer(port, port->backoffEnd);
+}
+
+
+static void hub_portStatusPower(hub_port_t *port, usb_port_status_t *status, time_t now)
+{
+	/* Changes reported while the power settles are handled once it is good */
+	if (now < port->backoffEnd) {
+		hub_portTimer(port, port->backoffEnd);
+		return;
+	}
+
+	hub_clearPortFeatures(port->hub, port->num, status->wPortChange);
+	port->retries = HUB_ENUM_RETRIES;
+	if (status->wPortStatus & USB_PORT_STAT_CONNECTION)
+		hub_portDebounceStart(port, status, now);
+	else
+		port->state = hub_port_idle;
+}
+
+
+/* Reads all ports of a freshly powered hub in one pass once its power is good,
+ * returns 0 if port was handled with the rest of them */
+static int hub_portsPowerScan(hub_port_t *port, time_t now)
+{
+	usb_dev_t *hub = port->hub;
+	usb_port_status_t *status;
+	hub_port_t *p;
+	int i, scan, ret = -ENOMEM;
+
+	mutexLock(hub_common.lock);
+	scan = hub->powerScan && now >= port->backoffEnd;
+	if (scan)
+		hub->powerScan = 0;
+	mutexUnlock(hub_common.lock);
+
+	if (!scan)
+		return -EAGAIN;
+
+	if ((status = malloc(hub->nports * sizeof(usb_port_status_t))) != NULL)
+		ret = hub_getPortsStatus(hub, status);
+
+	/* Only ports with a device go on to debounce, on failure each port reads its own status */
+	mutexLock(hub_common.lock);
+	for (i = 0; i < hub->nports; i++) {
+		p = &hub->ports[i];
+		if (p == port || p->state != hub_port_power)
+			continue;
+
+		if (ret < 0 || (status[i].wPortStatus & USB_PORT_STAT_CONNECTION) || status[i].wPortChange != 0) {
+			_hub_portQueue(p);
+		}
+		else if (!p->busy && !p->queued) {
+			_hub_portTimerCancel(p);
+			p->state = hub_port_idle;
+		}
 	}
+	mutexUnlock(hub_common.lock);
 
-	if (status.wPortChange & USB_PORT_STAT_C_RESET)
-		hub_clearPortFeature(hub, port, USB_PORT_FEAT_C_RESET);
+	if (ret >= 0)
+		hub_portStatusPower(port, &status[port->num - 1], now);
+	free(status);
 
-	if (connection)
-		hub_connectstatus(hub, port, &status);
+	return (ret < 0) ? ret : 0;
 }
 
 
-static uint32_t hub_getStatus(usb_dev_t *hub)
+static void hub_portProcess(hub_port_t *port)
 {
-	uint32_t status = 0;
+	usb_port_status_t status;
+	time_t now;
 
-	if (usb_transferCheck(hub->statusTransfer)) {
-		if (hub->statusTransfer->error == 0 && hub->statusTransfer->transferred > 0)
-			memcpy(&status, hub->statusTransfer->buffer, sizeof(status));
+	gettime(&now, NULL);
 
-		hub_poll(hub);
+	if (port->state == hub_port_power && hub_portsPowerScan(port, now) == 0)
+		return;
+
+	if (hub_getPortStatus(port->hub, port->num, &status) < 0) {
+		if (port->state != hub_port_disabled)
+			hub_portIdle(port);
+		else
+			hub_portTimer(port, now + HUB_DISABLE_RETRY);
+		return;
 	}
 
-	return status;
+	switch (port->state) {
+		case hub_port_idle:
+			hub_portStatusIdle(port, &status, now);
+			break;
+
+		case hub_port_debounce:
+			hub_portStatusDebounce(port, &status, now);
+			break;
+
+		case hub_port_resetWait:
+			hub_portResetStart(port, &status, now);
+			break;
+
+		case hub_port_reset:
+			hub_portStatusReset(port, &status, now);
+			break;
+
+		case hub_port_recovery:
+			hub_portStatusRecovery(port, &status, now);
+			break;
+
+		case hub_port_backoff:
+			hub_portStatusBackoff(port, &status, now);
+			break;
+
+		case hub_port_disabled:
+			hub_portStatusDisabled(port, &status, now);
+			break;
+
+		case hub_port_suspended:
+			hub_portStatusSuspended(port, &status, now);
+			break;
+
+		case hub_port_resume:
+			hub_portStatusResume(port, &status, now);
+			break;
+
+		case hub_port_power:
+			hub_portStatusPower(port, &status, now);
+			break;
+
+		default:
+			hub_portIdle(port);
+			break;
+	}
 }
 
 
-static void hub_thread(void *args)
+static void _hub_eventProcess(usb_dev_t *hub)
 {
-	hub_event_t *ev;
-	uint32_t status;
 	int i;
 
+	/* Everything reported since the last wakeup is handled in one pass */
+	for (i = 1; i <= hub->nports; i++) {
+		if (hub->changes[i / 8] & (1 << (i % 8)))
+			_hub_portQueue(&hub->ports[i - 1]);
+	}
+
+	memset(hub->changes, 0, hub->statusTransfer->size);
+}
+
+
+static void hub_worker(void *args)
+{
+	hub_port_t *port;
+	usb_dev_t *hub;
+	usb_transfer_t *t;
+	time_t now, timeout;
+	int ret;
+
 	for (;;) {
 		mutexLock(hub_common.lock);
-		while (hub_common.events == NULL)
-			condWait(hub_common.cond, hub_common.lock, 0);
-		ev = hub_common.events;
-		LIST_REMOVE(&hub_common.events, ev);
+		for (;;) {
+			gettime(&now, NULL);
+			timeout = _hub_timersExpire(now);
+			if (hub_common.events != NULL || hub_common.ports != NULL)
+				break;
+			condWait(hub_common.cond, hub_common.lock, timeout);
+		}
+
+		/* Hub status first, it only schedules port work */
+		if ((hub = hub_common.events) != NULL) {
+			LIST_REMOVE(&hub_common.events, hub);
+			hub->evPending = 0;
+			_hub_eventProcess(hub);
+
+			/* Status transfer failed earlier, retried once its backoff expired */
+			if ((t = hub->statusRearm) != NULL && hub->statusRetry == 0) {
+				hub->statusRearm = NULL;
+				hub->statusBusy++;
+				mutexUnlock(hub_common.lock);
+
+				ret = usb_transferSubmit(t, hub->irqPipe, NULL);
+
+				mutexLock(hub_common.lock);
+				hub->statusBusy--;
+				if (ret != 0 && !hub->detached) {
+					USB_LOG("hub: Fail to re-arm status transfer\n");
+					_hub_statusRetry(hub, t);
+				}
+				condBroadcast(hub_common.doneCond);
+			}
+			mutexUnlock(hub_common.lock);
+			continue;
+		}
+
+		port = hub_common.ports;
+		LIST_REMOVE(&hub_common.ports, port);
+		port->queued = 0;
+		port->busy = 1;
+		port->deadline = 0;
 		mutexUnlock(hub_common.lock);
 
-		status = hub_getStatus(ev->hub);
-		for (i = 0; i < ev->hub->nports; i++) {
-			if (status & (1 << (i + 1)))
-				hub_portstatus(ev->hub, i + 1);
+		hub_portProcess(port);
+
+		mutexLock(hub_common.lock);
+		port->busy = 0;
+		if (port->pending) {
+			port->pending = 0;
+			_hub_portQueue(port);
+		}
+		else if (port->deadline != 0) {
+			port->armed = 1;
+			LIST_ADD(&hub_common.timers, port);
+			/* Let sleeping workers recompute their timeout */
+			condSignal(hub_common.cond);
 		}
+		condBroadcast(hub_common.doneCond);
+		mutexUnlock(hub_common.lock);
+	}
+}
+
+
+void hub_notify(usb_dev_t *hub, usb_transfer_t *t)
+{
+	usb_transfer_t *next = (t == &hub->statusTransfer[0]) ? &hub->statusTransfer[1] : &hub->statusTransfer[0];
+	size_t i;
+	int ret;
 
-		free(ev);
+	mutexLock(hub_common.lock);
+	if (hub->detached) {
+		mutexUnlock(hub_common.lock);
+		return;
 	}
+
+	if (t->error != 0) {
+		_hub_statusRetry(hub, next);
+		mutexUnlock(hub_common.lock);
+		return;
+	}
+
+	/* Merged before the other buffer is armed, its completion may run concurrently */
+	for (i = 0; i < t->transferred && i < t->size; i++)
+		hub->changes[i] |= t->buffer[i];
+
+	hub->statusErrors = 0;
+	hub->statusBusy++;
+	_hub_eventQueue(hub);
+	mutexUnlock(hub_common.lock);
+
+	/* Re-arm at once, so no change goes unreported while the worker consumes this one */
+	ret = usb_transferSubmit(next, hub->irqPipe, NULL);
+
+	mutexLock(hub_common.lock);
+	hub->statusBusy--;
+	if (ret != 0 && !hub->detached) {
+		USB_LOG("hub: Fail to re-arm status transfer\n");
+		_hub_statusRetry(hub, next);
+	}
+	condBroadcast(hub_common.doneCond);
+	mutexUnlock(hub_common.lock);
 }
 
 
-void hub_notify(usb_dev_t *hub)
+void hub_devIdle(usb_dev_t *dev)
 {
-	hub_event_t *e;
+	usb_dev_t *hub = dev->hub;
+	hub_port_t *port;
+	time_t now;
 
-	if ((e = malloc(sizeof(hub_event_t))) == NULL)
+	if (hub == NULL)
 		return;
 
-	e->hub = hub;
+	gettime(&now, NULL);
 
 	mutexLock(hub_common.lock);
-	LIST_ADD(&hub_common.events, e);
-	condSignal(hub_common.cond);
+	if (!hub->detached && hub->ports != NULL) {
+		port = &hub->ports[dev->port - 1];
+		/* Autosuspend is decided by the port in its idle state */
+		if (port->state == hub_port_idle) {
+			if (port->busy) {
+				port->pending = 1;
+			}
+			else if (!port->queued && !port->armed) {
+				port->deadline = now + HUB_AUTOSUSPEND_DELAY;
+				port->armed = 1;
+				LIST_ADD(&hub_common.timers, port);
+				condSignal(hub_common.cond);
+			}
+		}
+	}
+	mutexUnlock(hub_common.lock);
+}
+
+
+void hub_devResume(usb_dev_t *dev)
+{
+	usb_dev_t *hub = dev->hub;
+	hub_port_t *port;
+
+	if (hub == NULL)
+		return;
+
+	mutexLock(hub_common.lock);
+	if (!hub->detached && hub->ports != NULL) {
+		port = &hub->ports[dev->port - 1];
+		port->resumeReq = 1;
+		_hub_portQueue(port);
+	}
+	mutexUnlock(hub_common.lock);
+}
+
+
+void hub_destroy(usb_dev_t *hub)
+{
+	hub_port_t *port;
+	int i;
+
+	mutexLock(hub_common.lock);
+	hub->detached = 1;
+
+	/* Drop queued event and port work referencing this hub */
+	if (hub->evPending) {
+		LIST_REMOVE(&hub_common.events, hub);
+		hub->evPending = 0;
+	}
+	_hub_statusTimerCancel(hub);
+	hub->statusRearm = NULL;
+	while (hub->statusBusy)
+		condWait(hub_common.doneCond, hub_common.lock, 0);
+
+	for (i = 0; i < hub->nports; i++) {
+		port = &hub->ports[i];
+		port->pending = 0;
+		_hub_portTimerCancel(port);
+		if (port->queued) {
+			LIST_REMOVE(&hub_common.ports, port);
+			port->queued = 0;
+		}
+	}
+
+	/* Wait for workers already handling it */
+	for (i = 0; i < hub->nports; i++) {
+		port = &hub->ports[i];
+		while (port->busy)
+			condWait(hub_common.doneCond, hub_common.lock, 0);
+
+		/* Worker stopped: no timer rearm for a detached hub */
+		_hub_portTimerCancel(port);
+		if (hub->hcd->enumOwner == port)
+			hub->hcd->enumOwner = NULL;
+	}
+
+	mutexUnlock(hub_common.lock);
+
+	/* Devices still being enumerated are not part of the tree */
+	for (i = 0; i < hub->nports; i++) {
+		if (hub->ports[i].dev != NULL) {
+			usb_devDisconnected(hub->ports[i].dev);
+			hub->ports[i].dev = NULL;
+		}
+	}
+}
+
+
+int hub_diag(char *buf, size_t size)
+{
+	size_t len = 0;
+	unsigned int i, n, first, e;
+	int ret;
+
+	mutexLock(hub_common.lock);
+	ret = snprintf(buf, size, "hub: port flaps %u enumeration failures %u ports disabled %u\n"
+		"hub: suspends %u resumes %u resume latency last %lld max %lld us\n",
+		hub_common.flaps, hub_common.failures, hub_common.disabled, hub_common.suspends, hub_common.resumes,
+		(long long)hub_common.resumeLast, (long long)hub_common.resumeMax);
+
+	/* Oldest entry first once the ring has wrapped */
+	n = min(hub_common.ndiag, HUB_DIAG_EVENTS);
+	first = hub_common.ndiag - n;
+	for (i = 0; i < n && ret > 0 && (len += ret) < size; i++) {
+		e = (first + i) % HUB_DIAG_EVENTS;
+		ret = snprintf(buf + len, size - len, "hub: %016llx port %d disabled after %d errors at %lld us\n",
+			(unsigned long long)hub_common.diag[e].locationID, hub_common.diag[e].port, hub_common.diag[e].errors,
+			(long long)hub_common.diag[e].time);
+	}
+
+	if (i == n && ret > 0)
+		len += ret;
+	mutexUnlock(hub_common.lock);
+
+	return min(len, size);
+}
+
+
+/* Ports are probed once their power is good, the worker woken by the first port reads all of them */
+static void hub_portsPowerWait(usb_dev_t *hub)
+{
+	hub_port_t *port;
+	time_t now;
+	int i;
+
+	gettime(&now, NULL);
+
+	mutexLock(hub_common.lock);
+	for (i = 0; i < hub->nports; i++) {
+		port = &hub->ports[i];
+		port->state = hub_port_power;
+		port->backoffEnd = now + hub->pwrGood;
+	}
+
+	if (hub->nports > 0) {
+		hub->powerScan = 1;
+		port = &hub->ports[0];
+		port->deadline = port->backoffEnd;
+		port->armed = 1;
+		LIST_ADD(&hub_common.timers, port);
+		condSignal(hub_common.cond);
+	}
 	mutexUnlock(hub_common.lock);
 }
 
 
 int hub_conf(usb_dev_t *hub)
 {
-	char buf[15];
+	char buf[USB_HUB_DESC_MAX_SIZE];
 	usb_hub_desc_t *desc;
-	int i;
+	int i, ret, nports;
 
 	if (hub_setConf(hub, 1) < 0) {
 		USB_LOG("hub: Fail to set configuration!\n");
 		return -EINVAL;
 	}
 
-	if (hub_getDesc(hub, buf, sizeof(buf)) < 0) {
+	/* Hub descriptors vary in size with the number of ports, ask for the largest possible one */
+	if ((ret = hub_getDesc(hub, buf, sizeof(buf))) < (int)sizeof(usb_hub_desc_t)) {
 		USB_LOG("hub: Fail to get descriptor\n");
 		return -EINVAL;
 	}
 
-	/* Hub descriptors might vary in size */
 	desc = (usb_hub_desc_t *)buf;
-	hub->nports = min(USB_HUB_MAX_PORTS, desc->bNbrPorts);
-	if ((hub->devs = calloc(hub->nports, sizeof(usb_dev_t *))) == NULL) {
+	if (desc->bDescriptorType != USB_DESC_TYPE_HUB || desc->bDescLength < sizeof(usb_hub_desc_t)) {
+		USB_LOG("hub: Invalid hub descriptor\n");
+		return -EINVAL;
+	}
+
+	nports = min(USB_HUB_MAX_PORTS, desc->bNbrPorts);
+	if ((hub->devs = calloc(nports, sizeof(usb_dev_t *))) == NULL) {
 		USB_LOG("hub: Out of memory!\n");
 		return -ENOMEM;
 	}
 
+	if ((hub->ports = calloc(nports, sizeof(hub_port_t))) == NULL) {
+		USB_LOG("hub: Out of memory!\n");
+		free(hub->devs);
+		hub->devs = NULL;
+		return -ENOMEM;
+	}
+
+	hub->nports = nports;
+
 	for (i = 0; i < hub->nports; i++) {
-		if (hub_setPortPower(hub, i + 1) < 0) {
-			USB_LOG("hub: Fail to set port %d power!\n", i + 1);
-			free(hub->devs);
-			return -EINVAL;
-		}
+		hub->ports[i].hub = hub;
+		hub->ports[i].num = i + 1;
+	}
+
+	if (hub_ttInit(hub, desc) < 0) {
+		USB_LOG("hub: Out of memory!\n");
+		return -ENOMEM;
+	}
+
+	if (hub_setPortsPower(hub) < 0) {
+		USB_LOG("hub: Fail to set ports power!\n");
+		return -EINVAL;
 	}
 
+	/* bPwrOn2PwrGood is given in 2 ms units */
+	hub->pwrGood = desc->bPwrOn2PwrGood * 2000;
+
 	if (hub_interruptInit(hub) != 0)
 		return -EINVAL;
 
+	hub_portsPowerWait(hub);
+
 	return hub_poll(hub);
 }
 
 
 int hub_init(void)
 {
+	int i;
+
 	if (mutexCreate(&hub_common.lock) != 0)
 		return -ENOMEM;
 
@@ -445,11 +1495,24 @@ int hub_init(void)
 		return -ENOMEM;
 	}
 
-	if (beginthread(hub_thread, 4, hub_common.stack, sizeof(hub_common.stack), NULL) != 0) {
+	if (condCreate(&hub_common.doneCond) != 0) {
 		resourceDestroy(hub_common.lock);
 		resourceDestroy(hub_common.cond);
 		return -ENOMEM;
 	}
 
+	for (i = 0; i < HUB_NWORKERS; i++) {
+		if (beginthread(hub_worker, HUB_WORKER_PRIO, hub_common.stack[i], sizeof(hub_common.stack[i]), NULL) != 0) {
+			/* Workers already started keep the resources in use */
+			if (i > 0)
+				break;
+
+			resourceDestroy(hub_common.lock);
+			resourceDestroy(hub_common.cond);
+			resourceDestroy(hub_common.doneCond);
+			return -ENOMEM;
+		}
+	}
+
 	return 0;
 }
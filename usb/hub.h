@@ -51,7 +51,17 @@
 #define USB_PORT_FEAT_TEST           21
 #define USB_PORT_FEAT_INDICATOR      22
 
-#define USB_HUB_MAX_PORTS 15
+#define USB_HUB_MAX_PORTS 255
+
+#define USB_HUB_PROTO_SINGLE_TT 1
+#define USB_HUB_PROTO_MULTI_TT  2
+
+/* TT think time in full-speed bit times, wHubCharacteristics encodes it in units of 8 */
+#define USB_HUB_TT_THINK_TIME(c) (((((c) >> 5) & 0x3) + 1) * 8)
+
+/* Status change bitmap: bit 0 for the hub, bit N for port N */
+#define USB_HUB_BITMAP_SIZE   ((USB_HUB_MAX_PORTS + 8) / 8)
+#define USB_HUB_DESC_MAX_SIZE (sizeof(usb_hub_desc_t) + 2 * USB_HUB_BITMAP_SIZE)
 
 typedef struct usb_port_status {
 	uint16_t wPortStatus;
@@ -76,7 +86,24 @@ int hub_init(void);
 int hub_conf(usb_dev_t *hub);
 
 
-void hub_notify(usb_dev_t *hub);
+void hub_notify(usb_dev_t *hub, usb_transfer_t *t);
+
+
+void hub_destroy(usb_dev_t *hub);
+
+
+void hub_statusFree(usb_dev_t *hub);
+
+
+int hub_diag(char *buf, size_t size);
+
+
+/* Called once the device has no transfers in flight */
+void hub_devIdle(usb_dev_t *dev);
+
+
+/* Asks the parent hub port to resume a suspended device */
+void hub_devResume(usb_dev_t *dev);
 
 
 void hub_interrupt(void);
@@ -248,6 +248,25 @@ void *usb_alloc(size_t size)
 }
 
 
+void *usb_allocDma(size_t size, size_t alignment)
+{
+	/* Pool chunks are aligned to their size granularity */
+	if (alignment <= USB_CHUNK_SIZE)
+		return usb_alloc(size);
+
+	return (size > 0) ? usb_allocAligned(size, alignment) : NULL;
+}
+
+
+void usb_freeDma(void *ptr, size_t size, size_t alignment)
+{
+	if (alignment <= USB_CHUNK_SIZE)
+		usb_free(ptr, size);
+	else if (ptr != NULL)
+		usb_freeAligned(ptr, size);
+}
+
+
 int usb_memInit(void)
 {
 	if ((usb_mem_common.buffer = usb_allocBuffer()) == NULL)
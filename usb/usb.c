@@ -21,6 +21,7 @@
 #include <sys/types.h>
 #include <sys/threads.h>
 #include <posix/utils.h>
+#include <sys/minmax.h>
 
 #include <string.h>
 #include <stdio.h>
@@ -34,20 +35,38 @@
 #include "hub.h"
 
 
-#define N_STATUSTHRS   1
 #define STATUSTHR_PRIO 3
 #define MSGTHR_PRIO    3
 
+/* Adaptive completion handling defaults */
+#define USB_POLL_BUDGET   16   /* Completions handled per round */
+#define USB_POLL_ENTER    4    /* Backlog found on wakeup that switches to polling */
+#define USB_POLL_INTERVAL 1000 /* Polling period, in us */
+#define USB_POLL_IDLE     4    /* Empty rounds that switch back to wakeups */
+
+/* Upper bound of the budget, completions of a round are gathered on the status thread stack */
+#define USB_POLL_BUDGET_MAX 64
+
 
 static struct {
-	char stack[N_STATUSTHRS][2048] __attribute__((aligned(8)));
 	handle_t transferLock;
-	handle_t finishedCond;
-	hcd_t *hcds;
 	usb_drv_t *drvs;
-	usb_transfer_t *finished;
 	int nhcd;
 	uint32_t port;
+
+	/* Completion mode tunables, state is kept per hcd */
+	struct {
+		int budget;
+		int enter;
+		time_t interval;
+		int idle;
+	} poll;
+
+	/* Driver submissions accumulated by the message thread */
+	handle_t batchLock;
+	handle_t flushLock; /* Keeps taken batches in order on their way to the hcds */
+	usb_transfer_t *batch[USB_BATCH_MAX];
+	int nbatch;
 } usb_common;
 
 
@@ -63,10 +82,21 @@ int usb_transferCheck(usb_transfer_t *t)
 }
 
 
-int usb_transferSubmit(usb_transfer_t *t, usb_pipe_t *pipe, handle_t *cond)
+static size_t usb_transferChunk(usb_transfer_t *t, usb_pipe_t *pipe)
 {
-	hcd_t *hcd = pipe->dev->hcd;
-	int ret = 0;
+	size_t limit = pipe->dev->hcd->caps.maxTransfer;
+
+	if (t->type != usb_transfer_bulk || limit == 0 || t->size <= limit)
+		return 0;
+
+	/* Whole packets per chunk keep short packet detection working */
+	return limit - limit % max(pipe->maxPacketLen, 1);
+}
+
+
+static void usb_transferPrepare(usb_transfer_t *t, usb_pipe_t *pipe)
+{
+	size_t chunk = usb_transferChunk(t, pipe);
 
 	mutexLock(usb_common.transferLock);
 	t->finished = 0;
@@ -74,30 +104,302 @@ int usb_transferSubmit(usb_transfer_t *t, usb_pipe_t *pipe, handle_t *cond)
 	t->transferred = 0;
 	if (t->direction == usb_dir_in)
 		memset(t->buffer, 0, t->size);
+	t->pipe = pipe;
+
+	t->splitBuffer = NULL;
+	t->cancelled = 0;
+	if (chunk != 0) {
+		t->splitBuffer = t->buffer;
+		t->splitSize = t->size;
+		t->splitDone = 0;
+		t->size = chunk;
+	}
 	mutexUnlock(usb_common.transferLock);
+}
+
 
-	if ((ret = hcd->ops->transferEnqueue(hcd, t, pipe)) != 0)
+/* Returns 1 if the split transfer continues with its next chunk, 0 if it ended.
+ * Called with the transfer lock held, status of the whole transfer is returned in status */
+static int _usb_transferSplit(usb_transfer_t *t, int *status)
+{
+	if (*status > 0)
+		t->splitDone += *status;
+
+	/* Errors, short chunks and cancellation end the transfer */
+	if (*status >= 0 && (size_t)*status == t->size && t->splitDone < t->splitSize && !t->cancelled) {
+		t->buffer = t->splitBuffer + t->splitDone;
+		t->size = min(t->size, t->splitSize - t->splitDone);
+		return 1;
+	}
+
+	if (*status >= 0)
+		*status = t->cancelled ? -ECANCELED : (int)t->splitDone;
+
+	t->buffer = t->splitBuffer;
+	t->size = t->splitSize;
+	t->splitBuffer = NULL;
+
+	return 0;
+}
+
+
+void usb_transferCancel(usb_transfer_t *t, usb_pipe_t *pipe)
+{
+	hcd_t *hcd = pipe->dev->hcd;
+
+	/* Seen by a chunk completing meanwhile or by the status thread queueing the next one */
+	mutexLock(usb_common.transferLock);
+	t->cancelled = 1;
+	mutexUnlock(usb_common.transferLock);
+
+	/* Batch taken earlier is in the hcd once flushLock is free, a later one drops the transfer */
+	mutexLock(usb_common.flushLock);
+	mutexUnlock(usb_common.flushLock);
+
+	hcd->ops->transferDequeue(hcd, t);
+}
+
+
+int usb_transferSubmit(usb_transfer_t *t, usb_pipe_t *pipe, handle_t *cond)
+{
+	hcd_t *hcd = pipe->dev->hcd;
+	int ret = 0;
+
+	usb_transferPrepare(t, pipe);
+
+	/* Driver transfers to a suspended device are enqueued once it resumes. Internal ones never
+	 * target a suspended device: enumeration ends before the port may suspend it, and hubs,
+	 * the only targets after that, are never suspended as they keep their status transfer queued */
+	if (t->port != 0 && usb_devPmGet(pipe->dev, t) != 0)
+		return 0;
+
+	if ((ret = hcd->ops->transferEnqueue(hcd, t, pipe)) != 0) {
+		if (t->port != 0)
+			usb_devPmPut(pipe->dev);
 		return ret;
+	}
 
 	/* Internal blocking transfer */
-	if (cond != NULL) {
-		mutexLock(usb_common.transferLock);
+	if (cond != NULL)
+		usb_transferWait(t, *cond);
 
-		while (!t->finished)
-			condWait(*cond, usb_common.transferLock, 0);
-		mutexUnlock(usb_common.transferLock);
+	return ret;
+}
+
+
+/* Takes the accumulated batch, called with batchLock held */
+static int _usb_batchTake(usb_transfer_t **batch)
+{
+	int n = usb_common.nbatch;
+
+	memcpy(batch, usb_common.batch, n * sizeof(*batch));
+	usb_common.nbatch = 0;
+
+	/* Taken before batchLock is released, later batches queue up behind this one */
+	if (n > 0)
+		mutexLock(usb_common.flushLock);
+
+	return n;
+}
+
+
+/* Hands a taken batch to the hcds, called with flushLock held which it releases */
+static void usb_batchSubmit(usb_transfer_t **batch, int nbatch)
+{
+	usb_transfer_t *ts[USB_BATCH_MAX], *failed[USB_BATCH_MAX], *cancelled[USB_BATCH_MAX];
+	hcd_t *hcd;
+	int i, j, n, done, nfailed = 0, ncancelled = 0;
+
+	/* Cancelled while waiting in the batch, the hcd would never see its dequeue */
+	mutexLock(usb_common.transferLock);
+	for (i = 0; i < nbatch; i++) {
+		if (batch[i]->cancelled) {
+			cancelled[ncancelled++] = batch[i];
+			batch[i] = NULL;
+		}
 	}
+	mutexUnlock(usb_common.transferLock);
 
-	return ret;
+	for (i = 0; i < nbatch; i++) {
+		if (batch[i] == NULL)
+			continue;
+
+		/* Transfers of one controller go together, in submission order */
+		hcd = batch[i]->pipe->dev->hcd;
+		for (j = i, n = 0; j < nbatch; j++) {
+			if (batch[j] != NULL && batch[j]->pipe->dev->hcd == hcd) {
+				ts[n++] = batch[j];
+				batch[j] = NULL;
+			}
+		}
+
+		if (hcd->ops->transferEnqueueBatch != NULL) {
+			done = max(hcd->ops->transferEnqueueBatch(hcd, ts, n), 0);
+			for (j = done; j < n; j++)
+				failed[nfailed++] = ts[j];
+		}
+		else {
+			for (j = 0; j < n; j++) {
+				if (hcd->ops->transferEnqueue(hcd, ts[j], ts[j]->pipe) != 0)
+					failed[nfailed++] = ts[j];
+			}
+		}
+	}
+	mutexUnlock(usb_common.flushLock);
+
+	/* Submission already succeeded for the driver, failures are reported as completions */
+	for (i = 0; i < nfailed; i++)
+		usb_transferFinished(failed[i], -EIO);
+
+	for (i = 0; i < ncancelled; i++)
+		usb_transferFinished(cancelled[i], -ECANCELED);
+}
+
+
+static void usb_batchAdd(usb_transfer_t *t)
+{
+	usb_transfer_t *batch[USB_BATCH_MAX];
+	int n = 0;
+
+	mutexLock(usb_common.batchLock);
+	if (usb_common.nbatch == USB_BATCH_MAX)
+		n = _usb_batchTake(batch);
+
+	usb_common.batch[usb_common.nbatch++] = t;
+	mutexUnlock(usb_common.batchLock);
+
+	if (n > 0)
+		usb_batchSubmit(batch, n);
+}
+
+
+void usb_transferQueue(usb_transfer_t *t, usb_pipe_t *pipe)
+{
+	usb_transferPrepare(t, pipe);
+
+	if (usb_devPmGet(pipe->dev, t) == 0)
+		usb_batchAdd(t);
+}
+
+
+/* Queues the next chunk of a split transfer like any driver submission, status thread only */
+static void usb_transferChunkQueue(usb_transfer_t *t)
+{
+	hcd_t *hcd = t->pipe->dev->hcd;
+	int cancelled;
+
+	/* Device power reference is held until the whole transfer ends */
+	usb_batchAdd(t);
+	usb_transferFlush();
+
+	/* Batches taken earlier reach the hcds before flushLock is free, the chunk is there now */
+	mutexLock(usb_common.flushLock);
+	mutexUnlock(usb_common.flushLock);
+
+	/* Cancel that came while the chunk was on its way found nothing to dequeue */
+	mutexLock(usb_common.transferLock);
+	cancelled = t->cancelled;
+	mutexUnlock(usb_common.transferLock);
+
+	if (cancelled)
+		hcd->ops->transferDequeue(hcd, t);
+}
+
+
+void usb_transferFlush(void)
+{
+	usb_transfer_t *batch[USB_BATCH_MAX];
+	int n;
+
+	mutexLock(usb_common.batchLock);
+	n = _usb_batchTake(batch);
+	mutexUnlock(usb_common.batchLock);
+
+	if (n > 0)
+		usb_batchSubmit(batch, n);
+}
+
+
+void usb_transferUnqueue(usb_pipe_t *pipe)
+{
+	usb_transfer_t *t, *next, *chunks = NULL, *cancelled[USB_BATCH_MAX];
+	hcd_completion_t *c = &pipe->dev->hcd->completion;
+	int i, k, n = 0;
+
+	mutexLock(usb_common.batchLock);
+	for (i = 0; i < usb_common.nbatch; i++) {
+		if ((t = usb_common.batch[i]) != NULL && t->pipe == pipe) {
+			usb_common.batch[i] = NULL;
+			cancelled[n++] = t;
+		}
+	}
+	mutexUnlock(usb_common.batchLock);
+
+	/* Split transfers of the pipe between their chunks, ones being queued reach the batch first */
+	mutexLock(c->lock);
+	while (c->chunksBusy)
+		condWait(c->chunksCond, c->lock, 0);
+
+	if ((t = c->chunks) != NULL) {
+		k = 0;
+		do {
+			k++;
+			t = t->next;
+		} while (t != c->chunks);
+
+		for (i = 0; i < k; i++) {
+			next = t->next;
+			if (t->pipe == pipe) {
+				LIST_REMOVE(&c->chunks, t);
+				LIST_ADD(&chunks, t);
+			}
+			t = next;
+		}
+	}
+	mutexUnlock(c->lock);
+
+	/* Batch taken earlier is in the hcds once it is free, pipe destruction cancels it there */
+	mutexLock(usb_common.flushLock);
+	mutexUnlock(usb_common.flushLock);
+
+	for (i = 0; i < n; i++)
+		usb_transferFinished(cancelled[i], -ECANCELED);
+
+	while ((t = chunks) != NULL) {
+		LIST_REMOVE(&chunks, t);
+		usb_transferFinished(t, -ECANCELED);
+	}
+}
+
+
+void usb_transferWait(usb_transfer_t *t, handle_t cond)
+{
+	mutexLock(usb_common.transferLock);
+	while (!t->finished)
+		condWait(cond, usb_common.transferLock, 0);
+	mutexUnlock(usb_common.transferLock);
 }
 
 
 /* Called by the hcd driver */
 void usb_transferFinished(usb_transfer_t *t, int status)
 {
-	int urbtrans = 0;
+	hcd_completion_t *c = NULL;
+	int urbtrans = 0, polling = 0;
 
 	mutexLock(usb_common.transferLock);
+	if (t->splitBuffer != NULL && _usb_transferSplit(t, &status) > 0) {
+		mutexUnlock(usb_common.transferLock);
+
+		/* Next chunk is queued by the status thread, not from the hcd completion context */
+		c = &t->pipe->dev->hcd->completion;
+		mutexLock(c->lock);
+		LIST_ADD(&c->chunks, t);
+		condSignal(c->cond);
+		mutexUnlock(c->lock);
+		return;
+	}
+
 	t->finished = 1;
 
 	if (status >= 0) {
@@ -113,31 +415,122 @@ void usb_transferFinished(usb_transfer_t *t, int status)
 	if (t->port != 0) {
 		urbtrans = 1;
 		t->state = urb_completed;
-		LIST_ADD(&usb_common.finished, t);
 	}
 
 	mutexUnlock(usb_common.transferLock);
 
+	if (urbtrans) {
+		/* Transfer may be freed by the status thread as soon as it is queued */
+		usb_devPmPut(t->pipe->dev);
+
+		/* Completions of each controller are queued to its own status thread */
+		c = &t->pipe->dev->hcd->completion;
+		mutexLock(c->lock);
+		LIST_ADD(&c->finished, t);
+		c->completions++;
+		c->backlog++;
+		polling = c->polling;
+		mutexUnlock(c->lock);
+	}
+
 	/* Internal transfer */
 	if (!urbtrans) {
-		if (t->type == usb_transfer_interrupt && t->transferred > 0)
-			hub_notify(t->hub);
+		if (t->hub != NULL)
+			hub_notify(t->hub, t);
 		else
 			usb_devSignal();
 	}
-	else {
-		/* URB transfer */
-		condSignal(usb_common.finishedCond);
+	else if (!polling) {
+		/* URB transfer, a polling status thread picks it up on its own */
+		condSignal(c->cond);
 	}
 }
 
 
-static int usb_devsList(char *buffer, size_t size)
+static int usb_pollDiag(char *buf, size_t size)
+{
+	int ret;
+
+	ret = snprintf(buf, size, "usb: poll budget %d enter %d interval %lld us idle %d\n", usb_common.poll.budget,
+		usb_common.poll.enter, (long long)usb_common.poll.interval, usb_common.poll.idle);
+
+	return (ret < 0) ? 0 : min((size_t)ret, size);
+}
+
+
+/* Tunables are written as "<name> <value>" pairs, e.g. "budget 32 interval 500" */
+static int usb_pollWrite(char *buf)
 {
+	char *name, *val, *save;
+	int budget = usb_common.poll.budget, enter = usb_common.poll.enter, idle = usb_common.poll.idle;
+	time_t interval = usb_common.poll.interval;
+	long v;
+
+	for (name = strtok_r(buf, " \t\r\n", &save); name != NULL; name = strtok_r(NULL, " \t\r\n", &save)) {
+		if ((val = strtok_r(NULL, " \t\r\n", &save)) == NULL || (v = strtol(val, NULL, 0)) <= 0)
+			return -EINVAL;
+
+		if (strcmp(name, "budget") == 0)
+			budget = min(v, USB_POLL_BUDGET_MAX);
+		else if (strcmp(name, "enter") == 0)
+			enter = v;
+		else if (strcmp(name, "interval") == 0)
+			interval = v;
+		else if (strcmp(name, "idle") == 0)
+			idle = v;
+		else
+			return -EINVAL;
+	}
+
+	/* Status threads pick the new values up on their next round */
+	usb_common.poll.budget = budget;
+	usb_common.poll.enter = enter;
+	usb_common.poll.interval = interval;
+	usb_common.poll.idle = idle;
+
 	return 0;
 }
 
 
+/* Controls written to the server: "attach <hcd info index>", "detach <bus>" or poll tunables */
+static int usb_ctlWrite(const char *data, size_t size)
+{
+	char buf[128];
+	int ret;
+
+	if (data == NULL || size >= sizeof(buf))
+		return -EINVAL;
+
+	memcpy(buf, data, size);
+	buf[size] = '\0';
+
+	/* Done by the hcd init threads, drivers keep being served while their devices go away */
+	if (strncmp(buf, "attach ", 7) == 0)
+		ret = hcd_attachRequest(strtol(buf + 7, NULL, 0));
+	else if (strncmp(buf, "detach ", 7) == 0)
+		ret = hcd_detachRequest(strtol(buf + 7, NULL, 0));
+	else
+		ret = usb_pollWrite(buf);
+
+	return (ret < 0) ? ret : (int)size;
+}
+
+
+static int usb_diagRead(char *buffer, size_t size, off_t offs)
+{
+	size_t len;
+
+	/* Whole report is produced by the first read */
+	if (buffer == NULL || offs != 0)
+		return 0;
+
+	len = usb_pollDiag(buffer, size);
+	len += hcd_diag(buffer + len, size - len);
+
+	return len + hub_diag(buffer + len, size - len);
+}
+
+
 
 static int usb_handleConnect(msg_t *msg, usb_connect_t *c)
 {
@@ -153,6 +546,7 @@ static int usb_handleConnect(msg_t *msg, usb_connect_t *c)
 
 	drv->pid = msg->pid;
 	drv->port = c->port;
+	drv->flags = c->flags;
 	drv->nfilters = c->nfilters;
 	memcpy(drv->filters, msg->i.data, msg->i.size);
 	usb_drvAdd(drv);
@@ -167,37 +561,36 @@ static int usb_handleOpen(usb_open_t *o, msg_t *msg)
 {
 	usb_drv_t *drv;
 	int pipe;
-	hcd_t *hcd;
 
 	if ((drv = usb_drvFind(msg->pid)) == NULL) {
 		USB_LOG("usb: Fail to find driver pid: %d\n", msg->pid);
 		return -EINVAL;
 	}
 
-	if ((hcd = hcd_find(usb_common.hcds, o->locationID)) == NULL) {
-		USB_LOG("usb: Fail to find dev: %d\n", o->dev);
-		return -EINVAL;
-	}
-
-	if ((pipe = usb_drvPipeOpen(drv, hcd, o->locationID, o->iface, o->dir, o->type)) < 0)
+	if ((pipe = usb_drvPipeOpen(drv, o->locationID, o->iface, o->dir, o->type)) < 0)
 		return -EINVAL;
 
 	return pipe;
 }
 
 
+static void usb_completionFill(usb_completion_t *c, usb_transfer_t *t)
+{
+	c->pipeid = t->pipeid;
+	c->urbid = t->linkage.id;
+	c->transferred = t->transferred;
+	c->err = t->error;
+}
+
+
 static void usb_urbAsyncCompleted(usb_transfer_t *t)
 {
 	msg_t msg = { 0 };
 	usb_msg_t *umsg = (usb_msg_t *)&msg.i.raw;
-	usb_completion_t *c = &umsg->completion;
 
 	umsg->type = usb_msg_completion;
-
-	c->pipeid = t->pipeid;
-	c->urbid = t->linkage.id;
-	c->transferred = t->transferred;
-	c->err = t->error;
+	umsg->version = USB_MSG_VERSION;
+	usb_completionFill(&umsg->completion, t);
 
 	msg.type = mtDevCtl;
 	if (t->direction == usb_dir_in) {
@@ -214,10 +607,16 @@ static void usb_urbAsyncCompleted(usb_transfer_t *t)
 static void usb_urbSyncCompleted(usb_transfer_t *t)
 {
 	msg_t msg = { 0 };
+	int expired;
+
+	expired = usb_drvTimeoutStop(t);
 
 	msg.type = mtDevCtl;
 	msg.pid = t->pid;
-	msg.o.err = (t->error != 0) ? -t->error : t->transferred;
+	if (t->error != 0)
+		msg.o.err = (expired < 0) ? expired : -t->error;
+	else
+		msg.o.err = t->transferred;
 
 	if (t->direction == usb_dir_in)
 		msg.o.data = t->buffer;
@@ -228,23 +627,148 @@ static void usb_urbSyncCompleted(usb_transfer_t *t)
 }
 
 
+static int usb_urbBatchable(usb_transfer_t *t)
+{
+	return t->async && t->batch && (t->direction != usb_dir_in || t->transferred == 0);
+}
+
+
+/* Sends consecutive async completions without data for the same driver in one message per cs[] worth */
+static void usb_urbsCompleted(usb_transfer_t **ts, int n)
+{
+	usb_completion_t cs[USB_POLL_BUDGET_MAX];
+	msg_t msg;
+	usb_msg_t *umsg = (usb_msg_t *)msg.i.raw;
+	int i, j, k;
+
+	for (i = 0; i < n; i = j) {
+		j = i + 1;
+		if (usb_urbBatchable(ts[i])) {
+			while (j < n && j - i < sizeof(cs) / sizeof(cs[0]) && usb_urbBatchable(ts[j]) && ts[j]->port == ts[i]->port)
+				j++;
+		}
+
+		if (j - i == 1) {
+			if (ts[i]->async)
+				usb_urbAsyncCompleted(ts[i]);
+			else
+				usb_urbSyncCompleted(ts[i]);
+			continue;
+		}
+
+		for (k = i; k < j; k++) {
+			usb_completionFill(&cs[k - i], ts[k]);
+			ts[k]->state = urb_idle;
+		}
+
+		memset(&msg, 0, sizeof(msg));
+		msg.type = mtDevCtl;
+		umsg->type = usb_msg_completionv;
+		umsg->version = USB_MSG_VERSION;
+		msg.i.data = cs;
+		msg.i.size = (j - i) * sizeof(cs[0]);
+
+		msgSend(ts[i]->port, &msg);
+
+		for (k = i; k < j; k++)
+			usb_transferPut(ts[k]);
+	}
+}
+
+
 static void usb_statusthr(void *arg)
 {
-	usb_transfer_t *t;
+	hcd_t *hcd = arg;
+	hcd_completion_t *c = &hcd->completion;
+	usb_transfer_t *t, *chunks, *batch[USB_POLL_BUDGET_MAX];
+	int n, idle = 0, prev, mode;
 
 	for (;;) {
-		mutexLock(usb_common.transferLock);
-		while (usb_common.finished == NULL)
-			condWait(usb_common.finishedCond, usb_common.transferLock, 0);
-		t = usb_common.finished;
-		LIST_REMOVE(&usb_common.finished, t);
-		mutexUnlock(usb_common.transferLock);
+		mutexLock(c->lock);
+		if (!c->polling) {
+			while (c->finished == NULL && c->chunks == NULL && !c->stop)
+				condWait(c->cond, c->lock, 0);
+			c->wakeups++;
+		}
+		else if (c->finished == NULL && c->chunks == NULL) {
+			/* Completions are not signalled, gather them for a period */
+			condWait(c->cond, c->lock, usb_common.poll.interval);
+		}
 
-		if (t->async)
-			usb_urbAsyncCompleted(t);
-		else
-			usb_urbSyncCompleted(t);
+		if (c->stop && c->finished == NULL && c->chunks == NULL) {
+			mutexUnlock(c->lock);
+			break;
+		}
+
+		if ((chunks = c->chunks) != NULL) {
+			c->chunks = NULL;
+			c->chunksBusy = 1;
+			mutexUnlock(c->lock);
+
+			while ((t = chunks) != NULL) {
+				LIST_REMOVE(&chunks, t);
+				usb_transferChunkQueue(t);
+			}
+
+			mutexLock(c->lock);
+			c->chunksBusy = 0;
+			condBroadcast(c->chunksCond);
+		}
+
+		c->backlogMax = max(c->backlogMax, c->backlog);
+
+		/* Switch to polling under load, back to wakeups once it is gone */
+		prev = c->polling;
+		if (!prev) {
+			if (c->backlog >= usb_common.poll.enter)
+				c->polling = 1;
+		}
+		else {
+			c->rounds++;
+			idle = (c->finished == NULL) ? idle + 1 : 0;
+			if (idle >= usb_common.poll.idle)
+				c->polling = 0;
+		}
+
+		mode = c->polling;
+		if (mode != prev) {
+			c->switches++;
+			idle = 0;
+		}
+
+		for (n = 0; n < min(usb_common.poll.budget, USB_POLL_BUDGET_MAX) && (t = c->finished) != NULL; n++) {
+			LIST_REMOVE(&c->finished, t);
+			c->backlog--;
+			batch[n] = t;
+		}
+		mutexUnlock(c->lock);
+
+		if (mode != prev && hcd->ops->setModeration != NULL)
+			hcd->ops->setModeration(hcd, mode);
+
+		usb_urbsCompleted(batch, n);
 	}
+
+	endthread();
+}
+
+
+int usb_statusStart(hcd_t *hcd)
+{
+	return beginthreadex(usb_statusthr, STATUSTHR_PRIO, hcd->completion.stack, sizeof(hcd->completion.stack), hcd, &hcd->completion.tid);
+}
+
+
+void usb_statusStop(hcd_t *hcd)
+{
+	hcd_completion_t *c = &hcd->completion;
+
+	mutexLock(c->lock);
+	c->stop = 1;
+	condSignal(c->cond);
+	mutexUnlock(c->lock);
+
+	threadJoin(c->tid, 0);
 }
 
 
@@ -263,10 +787,18 @@ static void usb_msgthr(void *arg)
 		resp = 1;
 		switch (msg.type) {
 			case mtRead:
-				msg.o.err = usb_devsList(msg.o.data, msg.o.size);
+				msg.o.err = usb_diagRead(msg.o.data, msg.o.size, msg.i.io.offs);
+				break;
+			case mtWrite:
+				msg.o.err = usb_ctlWrite(msg.i.data, msg.i.size);
 				break;
 			case mtDevCtl:
 				umsg = (usb_msg_t *)msg.i.raw;
+				if (umsg->version != USB_MSG_VERSION) {
+					msg.o.err = -EPROTO;
+					USB_LOG("usb: unsupported usb_msg version: %d\n", umsg->version);
+					break;
+				}
 				switch (umsg->type) {
 					case usb_msg_connect:
 						msg.o.err = usb_handleConnect(&msg, &umsg->connect);
@@ -287,6 +819,9 @@ static void usb_msgthr(void *arg)
 					case usb_msg_urbcmd:
 						msg.o.err = usb_handleUrbcmd(&msg);
 						break;
+					case usb_msg_autosuspend:
+						msg.o.err = usb_handleAutosuspend(&msg);
+						break;
 					default:
 						msg.o.err = -EINVAL;
 						USB_LOG("usb: unsupported usb_msg type: %d\n", umsg->type);
@@ -300,6 +835,8 @@ static void usb_msgthr(void *arg)
 
 		if (resp)
 			msgRespond(port, &msg, rid);
+
+		usb_transferFlush();
 	}
 }
 
@@ -307,14 +844,18 @@ static void usb_msgthr(void *arg)
 int main(int argc, char *argv[])
 {
 	oid_t oid;
-	int i;
 
 	if (mutexCreate(&usb_common.transferLock) != 0) {
 		USB_LOG("usb: Can't create mutex!\n");
 		return 1;
 	}
 
-	if (condCreate(&usb_common.finishedCond) != 0) {
+	usb_common.poll.budget = USB_POLL_BUDGET;
+	usb_common.poll.enter = USB_POLL_ENTER;
+	usb_common.poll.interval = USB_POLL_INTERVAL;
+	usb_common.poll.idle = USB_POLL_IDLE;
+
+	if (mutexCreate(&usb_common.batchLock) != 0 || mutexCreate(&usb_common.flushLock) != 0) {
 		USB_LOG("usb: Can't create mutex!\n");
 		return 1;
 	}
@@ -329,13 +870,13 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	if (hub_init() != 0) {
-		USB_LOG("usb: Fail to init hub driver!\n");
+	if (usb_drvInit() != 0) {
+		USB_LOG("usb: Fail to init drivers!\n");
 		return 1;
 	}
 
-	if ((usb_common.hcds = hcd_init()) == NULL) {
-		USB_LOG("usb: Fail to init hcds!\n");
+	if (hub_init() != 0) {
+		USB_LOG("usb: Fail to init hub driver!\n");
 		return 1;
 	}
 
@@ -352,11 +893,10 @@ int main(int argc, char *argv[])
 		return 1;
 	}
 
-	for (i = 0; i < N_STATUSTHRS; i++) {
-		if (beginthread(usb_statusthr, STATUSTHR_PRIO, &usb_common.stack[i], sizeof(usb_common.stack[i]), NULL) != 0) {
-			USB_LOG("usb: Fail to init hub driver!\n");
-			return 1;
-		}
+	/* Drivers may connect while root hubs are still being enumerated */
+	if (hcd_init() != 0) {
+		USB_LOG("usb: Fail to init hcds!\n");
+		return 1;
 	}
 
 	priority(MSGTHR_PRIO);
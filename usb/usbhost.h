@@ -33,6 +33,11 @@ typedef struct {
 	int num;
 	struct _usb_dev *dev;
 	void *hcdpriv;
+
+	/* Transaction translator reservation, see hcd_ttReserve() */
+	int ttFrame;
+	int ttPeriod;
+	int ttLoad;
 } usb_pipe_t;
 
 
@@ -53,6 +58,7 @@ typedef struct usb_transfer {
 	char *buffer;
 	size_t size;
 	size_t transferred;
+	size_t bufAlign;
 	int type;
 	int direction;
 	int pipeid;
@@ -64,8 +70,22 @@ typedef struct usb_transfer {
 	unsigned long rid;
 	unsigned int port;
 	pid_t pid;
+	unsigned batch; /* Completion may be coalesced into usb_msg_completionv */
+
+	/* Sync URB timeout */
+	struct usb_transfer *tnext, *tprev;
+	time_t deadline;
+	int timedOut;
 
 	struct _usb_dev *hub;
+	usb_pipe_t *pipe;
+	struct usb_transfer *qnext; /* hcd_queue_t linkage */
+
+	/* Transfers above the hcd limit are issued in chunks, protected by the transfer lock */
+	char *splitBuffer;
+	size_t splitSize;
+	size_t splitDone;
+	int cancelled;
 
 	void *hcdpriv;
 } usb_transfer_t;
@@ -92,6 +112,14 @@ void *usb_allocAligned(size_t size, size_t alignment);
 void usb_freeAligned(void *addr, size_t size);
 
 
+/* Transfer buffers for a controller of given DMA alignment, taken from the pool where it suffices */
+void *usb_allocDma(size_t size, size_t alignment);
+
+
+void usb_freeDma(void *addr, size_t size, size_t alignment);
+
+
+/* May enqueue a new transfer on the same pipe, must be called without the hcd's transfer lock held */
 void usb_transferFinished(usb_transfer_t *t, int status);
 
 
@@ -101,6 +129,26 @@ int usb_transferCheck(usb_transfer_t *t);
 int usb_transferSubmit(usb_transfer_t *t, usb_pipe_t *pipe, handle_t *cond);
 
 
+/* Dequeues a transfer from its hcd, a split transfer does not continue with the next chunk */
+void usb_transferCancel(usb_transfer_t *t, usb_pipe_t *pipe);
+
+
+/* Accumulates a driver transfer, message thread only. Enqueue errors are reported as completions */
+void usb_transferQueue(usb_transfer_t *t, usb_pipe_t *pipe);
+
+
+/* Hands accumulated transfers to the hcds, batched where supported */
+void usb_transferFlush(void);
+
+
+/* Cancels accumulated transfers of a pipe about to be destroyed */
+void usb_transferUnqueue(usb_pipe_t *pipe);
+
+
+/* Waits for an internal transfer submitted without a cond */
+void usb_transferWait(usb_transfer_t *t, handle_t cond);
+
+
 void usb_transferFree(usb_transfer_t *t);
 
 
@@ -0,0 +1,253 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Simulated USB host controller - topology scripts
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+/*
+ * One command per line, '#' starts a comment:
+ *
+ *   hub <name> <nports> [high|full|low]
+ *   dev <name> <vid> <pid> <class> [high|full|low]
+ *   ep <name> <address> <bulk|int|iso> <mps> [interval]
+ *   timing <name> <latency us> <bandwidth B/s>
+ *   plug <name> <hub name> <port>
+ *   unplug <name>
+ *   wait <ms>
+ *   expect <name> <default|addressed|configured> [timeout ms]
+ *   stats
+ *
+ * A failing command stops the script with an error, expectations make it a
+ * regression test of the host stack (see tests/).
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/threads.h>
+
+#include <usb.h>
+
+#include "usbsim.h"
+
+#define USBSIM_MAX_ARGS      8
+#define USBSIM_EXPECT_POLL    10000
+#define USBSIM_EXPECT_TIMEOUT 5000
+
+
+static int usbsim_speed(const char *str)
+{
+	if (str == NULL || strcmp(str, "full") == 0)
+		return usbsim_speed_full;
+	if (strcmp(str, "high") == 0)
+		return usbsim_speed_high;
+	if (strcmp(str, "low") == 0)
+		return usbsim_speed_low;
+
+	return -EINVAL;
+}
+
+
+static int usbsim_epType(const char *str)
+{
+	if (strcmp(str, "bulk") == 0)
+		return USB_ENDPT_TYPE_BULK;
+	if (strcmp(str, "int") == 0)
+		return USB_ENDPT_TYPE_INTR;
+	if (strcmp(str, "iso") == 0)
+		return USB_ENDPT_TYPE_ISO;
+
+	return -EINVAL;
+}
+
+
+static int usbsim_cmdDev(char **argv, int argc)
+{
+	usb_device_desc_t desc = { 0 };
+	int speed;
+
+	if (argc < 5 || (speed = usbsim_speed(argv[5])) < 0)
+		return -EINVAL;
+
+	desc.bcdUSB = (speed == usbsim_speed_high) ? 0x200 : 0x110;
+	desc.idVendor = strtoul(argv[2], NULL, 0);
+	desc.idProduct = strtoul(argv[3], NULL, 0);
+	desc.bDeviceClass = strtoul(argv[4], NULL, 0);
+	desc.bMaxPacketSize0 = 64;
+
+	return (usbsim_devCreate(argv[1], &desc, speed) != NULL) ? 0 : -ENOMEM;
+}
+
+
+static int usbsim_cmdHub(char **argv, int argc)
+{
+	int speed;
+
+	if (argc < 3 || (speed = usbsim_speed(argv[3])) < 0)
+		return -EINVAL;
+
+	return (usbsim_hubCreate(argv[1], atoi(argv[2]), speed) != NULL) ? 0 : -EINVAL;
+}
+
+
+static int usbsim_cmdEp(usbsim_dev_t *dev, char **argv, int argc)
+{
+	int type;
+
+	if (argc < 5 || (type = usbsim_epType(argv[3])) < 0)
+		return -EINVAL;
+
+	return usbsim_devEndpoint(dev, strtoul(argv[2], NULL, 0), type, strtoul(argv[4], NULL, 0),
+		(argc > 5) ? strtoul(argv[5], NULL, 0) : 0);
+}
+
+
+/* Waits for the host stack to bring the device to the given state */
+static int usbsim_cmdExpect(usbsim_dev_t *dev, char **argv, int argc)
+{
+	unsigned long timeout = (argc > 3) ? strtoul(argv[3], NULL, 0) : USBSIM_EXPECT_TIMEOUT;
+	unsigned long waited;
+	int address, configuration, reached;
+
+	if (argc < 3)
+		return -EINVAL;
+
+	for (waited = 0;; waited += USBSIM_EXPECT_POLL / 1000) {
+		usbsim_devStatus(dev, &address, &configuration);
+
+		if (strcmp(argv[2], "default") == 0)
+			reached = (address == 0);
+		else if (strcmp(argv[2], "addressed") == 0)
+			reached = (address != 0);
+		else if (strcmp(argv[2], "configured") == 0)
+			reached = (configuration != 0);
+		else
+			return -EINVAL;
+
+		if (reached)
+			return 0;
+
+		if (waited >= timeout)
+			return -ETIMEDOUT;
+
+		usleep(USBSIM_EXPECT_POLL);
+	}
+}
+
+
+/* Throughput and latency since the previous stats command, a benchmark is a pair of them around a load */
+static int usbsim_cmdStats(void)
+{
+	static usbsim_stats_t prev;
+	static time_t prevTime;
+	usbsim_stats_t st;
+	unsigned long long transfers, bytes;
+	time_t now, elapsed;
+
+	usbsim_statsGet(&st);
+	gettime(&now, NULL);
+
+	transfers = st.transfers - prev.transfers;
+	bytes = st.bytes - prev.bytes;
+	elapsed = (prevTime != 0) ? now - prevTime : 0;
+
+	printf("usbsim: transfers %llu bytes %llu errors %llu scans %llu in %lld us, %llu B/s, latency avg %lld max %lld us\n",
+		transfers, bytes, st.errors - prev.errors, st.scans - prev.scans, (long long)elapsed,
+		(elapsed > 0) ? bytes * 1000000 / elapsed : 0ULL,
+		(transfers > 0) ? (long long)((st.latency - prev.latency) / transfers) : 0LL, (long long)st.latencyMax);
+
+	prev = st;
+	prevTime = now;
+
+	return 0;
+}
+
+
+int usbsim_scriptLine(char *line)
+{
+	char *argv[USBSIM_MAX_ARGS + 1] = { NULL }, *tok, *save;
+	usbsim_dev_t *dev = NULL, *hub;
+	int argc = 0;
+
+	if ((tok = strchr(line, '#')) != NULL)
+		*tok = '\0';
+
+	for (tok = strtok_r(line, " \t\r\n", &save); tok != NULL && argc < USBSIM_MAX_ARGS; tok = strtok_r(NULL, " \t\r\n", &save))
+		argv[argc++] = tok;
+
+	if (argc == 0)
+		return 0;
+
+	if (strcmp(argv[0], "dev") == 0)
+		return usbsim_cmdDev(argv, argc);
+
+	if (strcmp(argv[0], "hub") == 0)
+		return usbsim_cmdHub(argv, argc);
+
+	if (strcmp(argv[0], "stats") == 0)
+		return usbsim_cmdStats();
+
+	if (strcmp(argv[0], "wait") == 0 && argc > 1) {
+		usleep(strtoul(argv[1], NULL, 0) * 1000);
+		return 0;
+	}
+
+	/* Remaining commands refer to an existing device */
+	if (argc < 2 || (dev = usbsim_devFind(argv[1])) == NULL)
+		return -ENOENT;
+
+	if (strcmp(argv[0], "ep") == 0)
+		return usbsim_cmdEp(dev, argv, argc);
+
+	if (strcmp(argv[0], "timing") == 0 && argc > 3) {
+		usbsim_devTiming(dev, strtoul(argv[2], NULL, 0), strtoul(argv[3], NULL, 0));
+		return 0;
+	}
+
+	/* Root hub is named "root", a mistyped hub name must not fall back to it */
+	if (strcmp(argv[0], "plug") == 0 && argc > 3) {
+		if ((hub = usbsim_devFind(argv[2])) == NULL)
+			return -ENOENT;
+		return usbsim_plug(hub, atoi(argv[3]), dev);
+	}
+
+	if (strcmp(argv[0], "unplug") == 0)
+		return usbsim_unplug(dev);
+
+	if (strcmp(argv[0], "expect") == 0)
+		return usbsim_cmdExpect(dev, argv, argc);
+
+	return -EINVAL;
+}
+
+
+int usbsim_scriptRun(const char *path)
+{
+	char line[128];
+	FILE *f;
+	int n = 0, ret = 0;
+
+	if ((f = fopen(path, "r")) == NULL)
+		return -ENOENT;
+
+	while (fgets(line, sizeof(line), f) != NULL) {
+		n++;
+		if ((ret = usbsim_scriptLine(line)) < 0) {
+			fprintf(stderr, "usbsim: %s:%d: error %d\n", path, n, ret);
+			break;
+		}
+	}
+
+	fclose(f);
+
+	return ret;
+}
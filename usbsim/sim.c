@@ -0,0 +1,1187 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Simulated USB host controller
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/list.h>
+#include <sys/minmax.h>
+#include <sys/threads.h>
+#include <sys/types.h>
+
+#include <usb.h>
+
+#include <usbhost.h>
+#include <hcd.h>
+#include <hub.h>
+#include <hcdsched.h>
+
+#include "usbsim.h"
+
+#define USBSIM_PRIO         3
+#define USBSIM_RESET_TIME   10000
+#define USBSIM_RESUME_TIME  20000
+#define USBSIM_MAX_TRANSFER (16 * 1024)
+#define USBSIM_DEPTH        8     /* Transfers in flight per endpoint */
+#define USBSIM_FRAME_BUDGET 48000 /* Periodic bytes per frame, 80% of high-speed */
+#define USBSIM_CONF_SIZE    (sizeof(usb_configuration_desc_t) + sizeof(usb_interface_desc_t) + USBSIM_MAX_EPS * sizeof(usb_endpoint_desc_t))
+
+
+typedef struct {
+	uint16_t status;
+	uint16_t change;
+	usbsim_dev_t *dev;
+} usbsim_port_t;
+
+
+typedef struct _usbsim_event {
+	struct _usbsim_event *next, *prev;
+	time_t due;
+	int status;
+	int done;
+	time_t submitted;
+
+	/* Transfer completion */
+	usb_transfer_t *t;
+	usb_pipe_t *pipe;
+	usbsim_dev_t *parked; /* Hub holding a status transfer until a port changes */
+
+	/* Port timer, t is NULL */
+	usbsim_dev_t *hub;
+	int port;
+} usbsim_event_t;
+
+
+struct usbsim_dev {
+	usbsim_dev_t *next, *prev;
+	char name[USBSIM_NAME_LEN];
+	usbsim_dev_t *parent;
+	int port;
+	int speed;
+	int address;
+	int configuration;
+
+	usb_device_desc_t desc;
+	usb_interface_desc_t iface;
+	usb_endpoint_desc_t eps[USBSIM_MAX_EPS];
+
+	time_t latency;
+	unsigned int bandwidth;
+	time_t busyUntil;
+
+	/* Hub */
+	int nports;
+	usbsim_port_t *ports;
+	usbsim_event_t *status;
+};
+
+
+static struct {
+	handle_t lock;
+	handle_t cond;
+	usbsim_dev_t *devs;
+	usbsim_dev_t *root;
+	usbsim_event_t *events;
+	usbsim_stats_t stats;
+	hcdsched_t sched;
+	handle_t tid;
+	int quit;
+	int scripted;
+
+	char stack[4096] __attribute__((aligned(8)));
+	char scriptStack[8192] __attribute__((aligned(8)));
+} usbsim_common;
+
+
+static const hcd_info_t usbsim_info[] = {
+	{ .type = "sim" }
+};
+
+
+int hcd_getInfo(const hcd_info_t **info)
+{
+	*info = usbsim_info;
+
+	return sizeof(usbsim_info) / sizeof(usbsim_info[0]);
+}
+
+
+static void _usbsim_eventAdd(usbsim_event_t *ev)
+{
+	usbsim_event_t *it;
+	int head;
+
+	if ((it = usbsim_common.events) == NULL) {
+		LIST_ADD(&usbsim_common.events, ev);
+		condSignal(usbsim_common.cond);
+		return;
+	}
+
+	/* Kept sorted by due time, equal ones in submission order */
+	do {
+		if (it->due > ev->due)
+			break;
+		it = it->next;
+	} while (it != usbsim_common.events);
+
+	head = (it == usbsim_common.events && it->due > ev->due);
+
+	ev->next = it;
+	ev->prev = it->prev;
+	it->prev->next = ev;
+	it->prev = ev;
+
+	if (head) {
+		usbsim_common.events = ev;
+		/* Worker may sleep until a later deadline */
+		condSignal(usbsim_common.cond);
+	}
+}
+
+
+static int _usbsim_reachable(usbsim_dev_t *dev)
+{
+	usbsim_port_t *p;
+
+	for (; dev->parent != NULL; dev = dev->parent) {
+		p = &dev->parent->ports[dev->port - 1];
+		if ((p->status & (USB_PORT_STAT_ENABLE | USB_PORT_STAT_SUSPEND)) != USB_PORT_STAT_ENABLE)
+			return 0;
+	}
+
+	return (dev == usbsim_common.root);
+}
+
+
+static usbsim_dev_t *_usbsim_route(usb_pipe_t *pipe)
+{
+	usbsim_dev_t *dev;
+
+	if (usb_isRoothub(pipe->dev))
+		return usbsim_common.root;
+
+	if ((dev = usbsim_common.devs) == NULL)
+		return NULL;
+
+	do {
+		if (dev != usbsim_common.root && dev->address == pipe->dev->address && _usbsim_reachable(dev))
+			return dev;
+		dev = dev->next;
+	} while (dev != usbsim_common.devs);
+
+	return NULL;
+}
+
+
+static void _usbsim_hubNotify(usbsim_dev_t *hub)
+{
+	usbsim_event_t *ev;
+	time_t now;
+	int i;
+
+	if ((ev = hub->status) == NULL)
+		return;
+
+	for (i = 0; i < hub->nports; i++) {
+		if (hub->ports[i].change != 0)
+			break;
+	}
+
+	if (i == hub->nports)
+		return;
+
+	LIST_REMOVE(&hub->status, ev);
+	ev->parked = NULL;
+
+	gettime(&now, NULL);
+	ev->due = now + hub->latency;
+	_usbsim_eventAdd(ev);
+}
+
+
+static void _usbsim_portTimerStart(usbsim_dev_t *hub, int port, time_t delay)
+{
+	usbsim_event_t *ev;
+	time_t now;
+
+	if ((ev = calloc(1, sizeof(*ev))) == NULL)
+		return;
+
+	gettime(&now, NULL);
+	ev->due = now + delay;
+	ev->hub = hub;
+	ev->port = port;
+	_usbsim_eventAdd(ev);
+}
+
+
+static void _usbsim_portTimer(usbsim_dev_t *hub, int port)
+{
+	usbsim_port_t *p = &hub->ports[port - 1];
+
+	if (p->status & USB_PORT_STAT_RESET) {
+		p->status &= ~(USB_PORT_STAT_RESET | USB_PORT_STAT_LOW_SPEED | USB_PORT_STAT_HIGH_SPEED);
+		if ((p->status & USB_PORT_STAT_CONNECTION) && p->dev != NULL) {
+			p->status |= USB_PORT_STAT_ENABLE;
+			if (p->dev->speed == usbsim_speed_high)
+				p->status |= USB_PORT_STAT_HIGH_SPEED;
+			else if (p->dev->speed == usbsim_speed_low)
+				p->status |= USB_PORT_STAT_LOW_SPEED;
+
+			/* Reset returns the device to the default state */
+			p->dev->address = 0;
+			p->dev->configuration = 0;
+		}
+		p->change |= USB_PORT_STAT_C_RESET;
+	}
+	else if (p->status & USB_PORT_STAT_SUSPEND) {
+		p->status &= ~USB_PORT_STAT_SUSPEND;
+		p->change |= USB_PORT_STAT_C_SUSPEND;
+	}
+	else {
+		return;
+	}
+
+	_usbsim_hubNotify(hub);
+}
+
+
+static int _usbsim_portFeature(usbsim_dev_t *hub, int port, int feature, int set)
+{
+	usbsim_port_t *p;
+
+	if (port < 1 || port > hub->nports)
+		return -EPIPE;
+
+	p = &hub->ports[port - 1];
+
+	switch (feature) {
+		case USB_PORT_FEAT_POWER:
+			if (!set) {
+				p->status = 0;
+				p->change = 0;
+			}
+			else if (!(p->status & USB_PORT_STAT_POWER)) {
+				p->status |= USB_PORT_STAT_POWER;
+				if (p->dev != NULL) {
+					p->status |= USB_PORT_STAT_CONNECTION;
+					p->change |= USB_PORT_STAT_C_CONNECTION;
+				}
+			}
+			break;
+
+		case USB_PORT_FEAT_RESET:
+			if (set && (p->status & USB_PORT_STAT_CONNECTION) && !(p->status & USB_PORT_STAT_RESET)) {
+				p->status |= USB_PORT_STAT_RESET;
+				p->status &= ~(USB_PORT_STAT_ENABLE | USB_PORT_STAT_SUSPEND);
+				_usbsim_portTimerStart(hub, port, USBSIM_RESET_TIME);
+			}
+			break;
+
+		case USB_PORT_FEAT_ENABLE:
+			if (!set)
+				p->status &= ~USB_PORT_STAT_ENABLE;
+			break;
+
+		case USB_PORT_FEAT_SUSPEND:
+			if (set && (p->status & USB_PORT_STAT_ENABLE))
+				p->status |= USB_PORT_STAT_SUSPEND;
+			else if (!set && (p->status & USB_PORT_STAT_SUSPEND))
+				_usbsim_portTimerStart(hub, port, USBSIM_RESUME_TIME);
+			break;
+
+		case USB_PORT_FEAT_C_CONNECTION:
+		case USB_PORT_FEAT_C_ENABLE:
+		case USB_PORT_FEAT_C_SUSPEND:
+		case USB_PORT_FEAT_C_OVER_CURRENT:
+		case USB_PORT_FEAT_C_RESET:
+			if (!set)
+				p->change &= ~(1 << (feature - USB_PORT_FEAT_C_CONNECTION));
+			break;
+
+		default:
+			return -EPIPE;
+	}
+
+	_usbsim_hubNotify(hub);
+
+	return 0;
+}
+
+
+static int usbsim_confDesc(usbsim_dev_t *dev, char *buf)
+{
+	usb_configuration_desc_t *conf = (usb_configuration_desc_t *)buf;
+	size_t size = sizeof(*conf);
+	int i;
+
+	memcpy(buf + size, &dev->iface, sizeof(dev->iface));
+	size += sizeof(dev->iface);
+
+	for (i = 0; i < dev->iface.bNumEndpoints; i++) {
+		memcpy(buf + size, &dev->eps[i], sizeof(dev->eps[i]));
+		size += sizeof(dev->eps[i]);
+	}
+
+	conf->bLength = sizeof(*conf);
+	conf->bDescriptorType = USB_DESC_CONFIG;
+	conf->wTotalLength = size;
+	conf->bNumInterfaces = 1;
+	conf->bConfigurationValue = 1;
+	conf->iConfiguration = 0;
+	conf->bmAttributes = 0xc0;
+	conf->bMaxPower = 50;
+
+	return size;
+}
+
+
+static int usbsim_stringDesc(usbsim_dev_t *dev, int index, char *buf)
+{
+	const char *str;
+	int i;
+
+	buf[1] = USB_DESC_STRING;
+
+	if (index == 0) {
+		/* English (US) only */
+		buf[0] = 4;
+		buf[2] = 0x09;
+		buf[3] = 0x04;
+		return 4;
+	}
+
+	if (index == 1)
+		str = "usbsim";
+	else if (index == 2)
+		str = dev->name;
+	else
+		return -EPIPE;
+
+	for (i = 0; str[i] != '\0'; i++) {
+		buf[2 + 2 * i] = str[i];
+		buf[3 + 2 * i] = 0;
+	}
+	buf[0] = 2 + 2 * i;
+
+	return buf[0];
+}
+
+
+static int usbsim_hubDesc(usbsim_dev_t *hub, char *buf)
+{
+	usb_hub_desc_t *desc = (usb_hub_desc_t *)buf;
+	int n = hub->nports / 8 + 1;
+
+	desc->bDescLength = sizeof(*desc) + 2 * n;
+	desc->bDescriptorType = USB_DESC_TYPE_HUB;
+	desc->bNbrPorts = hub->nports;
+	desc->wHubCharacteristics = 0x0001; /* Individual port power switching */
+	desc->bPwrOn2PwrGood = 10;
+	desc->bHubContrCurrent = 0;
+
+	/* All devices removable, PortPwrCtrlMask set */
+	memset(desc->variable, 0, n);
+	memset(desc->variable + n, 0xff, n);
+
+	return desc->bDescLength;
+}
+
+
+static int _usbsim_control(usbsim_dev_t *dev, usb_setup_packet_t *setup, char *data, size_t size)
+{
+	char buf[USBSIM_CONF_SIZE + USB_HUB_DESC_MAX_SIZE];
+	usbsim_port_t *p;
+	int type = EXTRACT_REQ_TYPE(setup->bmRequestType);
+	int recipient = setup->bmRequestType & 0x1f;
+	int len = 0, ret = -EPIPE;
+
+	if (type == REQUEST_TYPE_STANDARD) {
+		switch (setup->bRequest) {
+			case REQ_GET_DESCRIPTOR:
+				switch (setup->wValue >> 8) {
+					case USB_DESC_DEVICE:
+						memcpy(buf, &dev->desc, sizeof(dev->desc));
+						len = sizeof(dev->desc);
+						break;
+					case USB_DESC_CONFIG:
+						len = usbsim_confDesc(dev, buf);
+						break;
+					case USB_DESC_STRING:
+						len = usbsim_stringDesc(dev, setup->wValue & 0xff, buf);
+						break;
+					default:
+						len = -EPIPE;
+						break;
+				}
+				ret = len;
+				break;
+
+			case REQ_SET_ADDRESS:
+				dev->address = setup->wValue & 0x7f;
+				ret = 0;
+				break;
+
+			case REQ_SET_CONFIGURATION:
+				dev->configuration = setup->wValue & 0xff;
+				ret = 0;
+				break;
+
+			case REQ_GET_CONFIGURATION:
+				buf[0] = dev->configuration;
+				ret = len = 1;
+				break;
+
+			case REQ_GET_STATUS:
+				memset(buf, 0, 2);
+				ret = len = 2;
+				break;
+
+			case REQ_SET_INTERFACE:
+			case REQ_CLEAR_FEATURE:
+			case REQ_SET_FEATURE:
+				ret = 0;
+				break;
+
+			default:
+				break;
+		}
+	}
+	else if (type == REQUEST_TYPE_CLASS && dev->ports != NULL) {
+		switch (setup->bRequest) {
+			case REQ_GET_DESCRIPTOR:
+				ret = len = usbsim_hubDesc(dev, buf);
+				break;
+
+			case REQ_GET_STATUS:
+				memset(buf, 0, 4);
+				if (recipient == REQUEST_RECIPIENT_OTHER) {
+					if (setup->wIndex < 1 || setup->wIndex > dev->nports)
+						break;
+					p = &dev->ports[setup->wIndex - 1];
+					memcpy(buf, &p->status, 2);
+					memcpy(buf + 2, &p->change, 2);
+				}
+				ret = len = 4;
+				break;
+
+			case REQ_SET_FEATURE:
+			case REQ_CLEAR_FEATURE:
+				if (recipient == REQUEST_RECIPIENT_OTHER)
+					ret = _usbsim_portFeature(dev, setup->wIndex, setup->wValue, setup->bRequest == REQ_SET_FEATURE);
+				else
+					ret = 0;
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	if (ret <= 0)
+		return ret;
+
+	/* Short answers are fine, the host asks for as much as it can take */
+	len = min(len, (int)min(size, setup->wLength));
+	if (data != NULL)
+		memcpy(data, buf, len);
+
+	return len;
+}
+
+
+static int _usbsim_transfer(usbsim_event_t *ev)
+{
+	usb_transfer_t *t = ev->t;
+	usbsim_dev_t *dev;
+	uint8_t *bitmap;
+	int i, ret;
+
+	if ((dev = _usbsim_route(ev->pipe)) == NULL)
+		return -EIO;
+
+	if (t->type == usb_transfer_control)
+		return _usbsim_control(dev, t->setup, t->buffer, t->size);
+
+	/* Hub status change endpoint */
+	if (dev->ports != NULL) {
+		bitmap = (uint8_t *)t->buffer;
+		memset(bitmap, 0, t->size);
+		for (i = 1, ret = 0; i <= dev->nports && i / 8 < t->size; i++) {
+			if (dev->ports[i - 1].change != 0) {
+				bitmap[i / 8] |= 1 << (i % 8);
+				ret = i / 8 + 1;
+			}
+		}
+
+		if (ret == 0) {
+			ev->parked = dev;
+			LIST_ADD(&dev->status, ev);
+			return -EAGAIN;
+		}
+
+		return ret;
+	}
+
+	for (i = 0; i < dev->iface.bNumEndpoints; i++) {
+		if ((dev->eps[i].bEndpointAddress & 0xf) == ev->pipe->num &&
+				!!(dev->eps[i].bEndpointAddress & 0x80) == (t->direction == usb_dir_in))
+			break;
+	}
+
+	if (i == dev->iface.bNumEndpoints)
+		return -EPIPE;
+
+	/* Incoming data is a pattern of the endpoint number */
+	if (t->direction == usb_dir_in)
+		memset(t->buffer, ev->pipe->num, t->size);
+
+	return t->size;
+}
+
+
+static time_t _usbsim_due(usb_transfer_t *t, usb_pipe_t *pipe, time_t now)
+{
+	usbsim_dev_t *dev;
+	time_t start = now, interval;
+
+	if ((dev = _usbsim_route(pipe)) == NULL)
+		return now;
+
+	/* Transfers to one device are serialized on its bandwidth */
+	if (dev->bandwidth != 0) {
+		start = max(now, dev->busyUntil) + (time_t)t->size * 1000000 / dev->bandwidth;
+		dev->busyUntil = start;
+	}
+
+	if (t->type == usb_transfer_interrupt && dev->ports == NULL) {
+		if (dev->speed == usbsim_speed_high)
+			interval = 125 << (max(pipe->interval, 1) - 1);
+		else
+			interval = pipe->interval * 1000;
+		start = max(start, now + interval);
+	}
+
+	return start + dev->latency;
+}
+
+
+/* Moves submitted transfers to the scheduler, whoever holds the lock is the queue consumer */
+static void _usbsim_drain(hcd_t *hcd, usb_transfer_t **done)
+{
+	usb_transfer_t *t, *next;
+	int ret;
+
+	for (t = hcd_queueTake(&hcd->queue); t != NULL; t = next) {
+		next = t->qnext;
+		if ((ret = hcdsched_enqueue(&usbsim_common.sched, t)) < 0) {
+			t->error = -ret;
+			t->transferred = 0;
+			LIST_ADD(done, t);
+		}
+	}
+}
+
+
+static void usbsim_worker(void *arg)
+{
+	hcd_t *hcd = arg;
+	usb_transfer_t *done = NULL;
+	usbsim_event_t *ev;
+	time_t now;
+
+	for (;;) {
+		mutexLock(usbsim_common.lock);
+		for (;;) {
+			_usbsim_drain(hcd, &done);
+			gettime(&now, NULL);
+			if (usbsim_common.quit || done != NULL || (usbsim_common.events != NULL && usbsim_common.events->due <= now))
+				break;
+			if (hcd_queueIdle(&hcd->queue))
+				condWait(usbsim_common.cond, usbsim_common.lock, (usbsim_common.events != NULL) ? usbsim_common.events->due - now : 0);
+		}
+
+		/* Everything due is handled in one pass */
+		while ((ev = usbsim_common.events) != NULL && ev->due <= now) {
+			LIST_REMOVE(&usbsim_common.events, ev);
+
+			if (ev->t == NULL) {
+				_usbsim_portTimer(ev->hub, ev->port);
+				free(ev);
+				continue;
+			}
+
+			if ((ev->status = _usbsim_transfer(ev)) == -EAGAIN)
+				continue;
+
+			usbsim_common.stats.transfers++;
+			if (ev->status < 0)
+				usbsim_common.stats.errors++;
+			else
+				usbsim_common.stats.bytes += ev->status;
+
+			/* Retired by the completion scan, as hardware descriptors are */
+			ev->done = 1;
+		}
+
+		hcdsched_scan(&usbsim_common.sched, &done);
+		usbsim_common.stats.scans = usbsim_common.sched.scans;
+		mutexUnlock(usbsim_common.lock);
+
+		/* Completion may submit further transfers */
+		hcdsched_complete(done);
+		done = NULL;
+
+		if (usbsim_common.quit)
+			break;
+	}
+
+	endthread();
+}
+
+
+static void usbsim_wake(void)
+{
+	mutexLock(usbsim_common.lock);
+	condSignal(usbsim_common.cond);
+	mutexUnlock(usbsim_common.lock);
+}
+
+
+/* Submission never waits for the worker, it only takes the lock to wake it up from idle */
+static int usbsim_transferEnqueue(hcd_t *hcd, usb_transfer_t *t, usb_pipe_t *pipe)
+{
+	if (hcd_queuePush(&hcd->queue, t))
+		usbsim_wake();
+
+	return 0;
+}
+
+
+static int usbsim_transferEnqueueBatch(hcd_t *hcd, usb_transfer_t **ts, int n)
+{
+	int i, wake = 0;
+
+	/* One worker wakeup at most for the whole batch */
+	for (i = 0; i < n; i++)
+		wake |= hcd_queuePush(&hcd->queue, ts[i]);
+
+	if (wake)
+		usbsim_wake();
+
+	return n;
+}
+
+
+static void usbsim_transferDequeue(hcd_t *hcd, usb_transfer_t *t)
+{
+	usb_transfer_t *done = NULL;
+
+	mutexLock(usbsim_common.lock);
+	_usbsim_drain(hcd, &done);
+	hcdsched_dequeue(&usbsim_common.sched, t, &done);
+	mutexUnlock(usbsim_common.lock);
+
+	hcdsched_complete(done);
+}
+
+
+static void usbsim_pipeDestroy(hcd_t *hcd, usb_pipe_t *pipe)
+{
+	usb_transfer_t *done = NULL;
+
+	mutexLock(usbsim_common.lock);
+	_usbsim_drain(hcd, &done);
+	hcdsched_pipeDestroy(&usbsim_common.sched, pipe, &done);
+	mutexUnlock(usbsim_common.lock);
+
+	hcdsched_complete(done);
+}
+
+
+/* Scheduler backend, an event stands for the hardware descriptor of a transfer */
+static int usbsim_encode(hcdsched_t *s, hcdsched_ep_t *ep, usb_transfer_t *t)
+{
+	usbsim_event_t *ev;
+
+	if ((ev = calloc(1, sizeof(*ev))) == NULL)
+		return -ENOMEM;
+
+	ev->t = t;
+	ev->pipe = ep->pipe;
+	gettime(&ev->submitted, NULL);
+	ev->due = _usbsim_due(t, ep->pipe, ev->submitted);
+	t->hcdpriv = ev;
+	_usbsim_eventAdd(ev);
+
+	return 0;
+}
+
+
+static int usbsim_decode(hcdsched_t *s, hcdsched_ep_t *ep, usb_transfer_t *t)
+{
+	usbsim_event_t *ev = t->hcdpriv;
+	time_t now, latency;
+	int status;
+
+	if (!ev->done)
+		return -EINPROGRESS;
+
+	gettime(&now, NULL);
+	latency = now - ev->submitted;
+	usbsim_common.stats.latency += latency;
+	usbsim_common.stats.latencyMax = max(usbsim_common.stats.latencyMax, latency);
+
+	status = ev->status;
+	t->hcdpriv = NULL;
+	free(ev);
+
+	return status;
+}
+
+
+static void usbsim_cancel(hcdsched_t *s, hcdsched_ep_t *ep, usb_transfer_t *t)
+{
+	usbsim_event_t *ev = t->hcdpriv;
+
+	if (!ev->done) {
+		if (ev->parked != NULL)
+			LIST_REMOVE(&ev->parked->status, ev);
+		else
+			LIST_REMOVE(&usbsim_common.events, ev);
+	}
+
+	t->hcdpriv = NULL;
+	free(ev);
+}
+
+
+static const hcdsched_ops_t usbsim_schedOps = {
+	.encode = usbsim_encode,
+	.decode = usbsim_decode,
+	.cancel = usbsim_cancel,
+};
+
+
+static uint32_t usbsim_getRoothubStatus(usb_dev_t *hub)
+{
+	uint32_t bitmap = 0;
+	int i;
+
+	mutexLock(usbsim_common.lock);
+	for (i = 0; i < usbsim_common.root->nports && i < 31; i++) {
+		if (usbsim_common.root->ports[i].change != 0)
+			bitmap |= 1u << (i + 1);
+	}
+	mutexUnlock(usbsim_common.lock);
+
+	return bitmap;
+}
+
+
+static usbsim_dev_t *usbsim_devAlloc(const char *name, int speed)
+{
+	usbsim_dev_t *dev;
+
+	if ((dev = calloc(1, sizeof(*dev))) == NULL)
+		return NULL;
+
+	strncpy(dev->name, name, sizeof(dev->name) - 1);
+	dev->speed = speed;
+
+	dev->iface.bLength = sizeof(dev->iface);
+	dev->iface.bDescriptorType = USB_DESC_INTERFACE;
+
+	return dev;
+}
+
+
+static void usbsim_devAdd(usbsim_dev_t *dev)
+{
+	mutexLock(usbsim_common.lock);
+	LIST_ADD(&usbsim_common.devs, dev);
+	mutexUnlock(usbsim_common.lock);
+}
+
+
+usbsim_dev_t *usbsim_devCreate(const char *name, const usb_device_desc_t *desc, int speed)
+{
+	usbsim_dev_t *dev;
+
+	if ((dev = usbsim_devAlloc(name, speed)) == NULL)
+		return NULL;
+
+	dev->desc = *desc;
+	dev->desc.bLength = sizeof(dev->desc);
+	dev->desc.bDescriptorType = USB_DESC_DEVICE;
+	dev->desc.bNumConfigurations = 1;
+	dev->desc.iManufacturer = 1;
+	dev->desc.iProduct = 2;
+	dev->desc.iSerialNumber = 0;
+	if (dev->desc.bMaxPacketSize0 == 0)
+		dev->desc.bMaxPacketSize0 = 64;
+
+	dev->iface.bInterfaceClass = desc->bDeviceClass;
+	dev->iface.bInterfaceSubClass = desc->bDeviceSubClass;
+	dev->iface.bInterfaceProtocol = desc->bDeviceProtocol;
+
+	usbsim_devAdd(dev);
+
+	return dev;
+}
+
+
+usbsim_dev_t *usbsim_hubCreate(const char *name, int nports, int speed)
+{
+	usb_device_desc_t desc = {
+		.bcdUSB = (speed == usbsim_speed_high) ? 0x200 : 0x110,
+		.bDeviceClass = USB_CLASS_HUB,
+		.bDeviceProtocol = (speed == usbsim_speed_high) ? USB_HUB_PROTO_SINGLE_TT : 0,
+		.bMaxPacketSize0 = 64,
+		.idVendor = 0x1d6b,
+		.idProduct = 0x0009,
+	};
+	usbsim_dev_t *dev;
+
+	if (nports < 1 || nports > USB_HUB_MAX_PORTS)
+		return NULL;
+
+	if ((dev = usbsim_devAlloc(name, speed)) == NULL)
+		return NULL;
+
+	if ((dev->ports = calloc(nports, sizeof(usbsim_port_t))) == NULL) {
+		free(dev);
+		return NULL;
+	}
+
+	dev->nports = nports;
+	dev->desc = desc;
+	dev->desc.bLength = sizeof(desc);
+	dev->desc.bDescriptorType = USB_DESC_DEVICE;
+	dev->desc.bNumConfigurations = 1;
+	dev->desc.iManufacturer = 1;
+	dev->desc.iProduct = 2;
+
+	dev->iface.bInterfaceClass = USB_CLASS_HUB;
+	dev->iface.bNumEndpoints = 1;
+	dev->eps[0] = (usb_endpoint_desc_t) {
+		.bLength = sizeof(usb_endpoint_desc_t),
+		.bDescriptorType = USB_DESC_ENDPOINT,
+		.bEndpointAddress = 0x81,
+		.bmAttributes = USB_ENDPT_TYPE_INTR,
+		.wMaxPacketSize = nports / 8 + 1,
+		.bInterval = (speed == usbsim_speed_high) ? 12 : 255,
+	};
+
+	usbsim_devAdd(dev);
+
+	return dev;
+}
+
+
+int usbsim_devEndpoint(usbsim_dev_t *dev, uint8_t addr, int type, uint16_t mps, uint8_t interval)
+{
+	int ret = 0;
+
+	mutexLock(usbsim_common.lock);
+	if (dev->ports != NULL || dev->iface.bNumEndpoints >= USBSIM_MAX_EPS || (addr & 0xf) == 0) {
+		ret = -EINVAL;
+	}
+	else {
+		dev->eps[dev->iface.bNumEndpoints++] = (usb_endpoint_desc_t) {
+			.bLength = sizeof(usb_endpoint_desc_t),
+			.bDescriptorType = USB_DESC_ENDPOINT,
+			.bEndpointAddress = addr,
+			.bmAttributes = type,
+			.wMaxPacketSize = mps,
+			.bInterval = interval,
+		};
+	}
+	mutexUnlock(usbsim_common.lock);
+
+	return ret;
+}
+
+
+void usbsim_devTiming(usbsim_dev_t *dev, time_t latency, unsigned int bandwidth)
+{
+	mutexLock(usbsim_common.lock);
+	dev->latency = latency;
+	dev->bandwidth = bandwidth;
+	mutexUnlock(usbsim_common.lock);
+}
+
+
+usbsim_dev_t *usbsim_devFind(const char *name)
+{
+	usbsim_dev_t *dev, *res = NULL;
+
+	mutexLock(usbsim_common.lock);
+	if ((dev = usbsim_common.devs) != NULL) {
+		do {
+			if (strcmp(dev->name, name) == 0) {
+				res = dev;
+				break;
+			}
+			dev = dev->next;
+		} while (dev != usbsim_common.devs);
+	}
+	mutexUnlock(usbsim_common.lock);
+
+	return res;
+}
+
+
+void usbsim_devStatus(usbsim_dev_t *dev, int *address, int *configuration)
+{
+	mutexLock(usbsim_common.lock);
+	*address = dev->address;
+	*configuration = dev->configuration;
+	mutexUnlock(usbsim_common.lock);
+}
+
+
+int usbsim_plug(usbsim_dev_t *hub, int port, usbsim_dev_t *dev)
+{
+	usbsim_port_t *p;
+	int ret = 0;
+
+	if (hub == NULL)
+		hub = usbsim_common.root;
+
+	mutexLock(usbsim_common.lock);
+	if (hub->ports == NULL || port < 1 || port > hub->nports || hub->ports[port - 1].dev != NULL ||
+			dev->parent != NULL || dev == usbsim_common.root || dev == hub) {
+		mutexUnlock(usbsim_common.lock);
+		return -EINVAL;
+	}
+
+	p = &hub->ports[port - 1];
+	p->dev = dev;
+	dev->parent = hub;
+	dev->port = port;
+
+	if (p->status & USB_PORT_STAT_POWER) {
+		p->status |= USB_PORT_STAT_CONNECTION;
+		p->change |= USB_PORT_STAT_C_CONNECTION;
+		_usbsim_hubNotify(hub);
+	}
+	mutexUnlock(usbsim_common.lock);
+
+	return ret;
+}
+
+
+static void _usbsim_powerOff(usbsim_dev_t *dev)
+{
+	int i;
+
+	dev->address = 0;
+	dev->configuration = 0;
+
+	/* Unplugged hub loses power on all its ports */
+	for (i = 0; i < dev->nports; i++) {
+		dev->ports[i].status = 0;
+		dev->ports[i].change = 0;
+		if (dev->ports[i].dev != NULL)
+			_usbsim_powerOff(dev->ports[i].dev);
+	}
+}
+
+
+int usbsim_unplug(usbsim_dev_t *dev)
+{
+	usbsim_dev_t *hub;
+	usbsim_port_t *p;
+
+	mutexLock(usbsim_common.lock);
+	if ((hub = dev->parent) == NULL) {
+		mutexUnlock(usbsim_common.lock);
+		return -EINVAL;
+	}
+
+	p = &hub->ports[dev->port - 1];
+	p->dev = NULL;
+	if (p->status & USB_PORT_STAT_CONNECTION) {
+		p->status &= USB_PORT_STAT_POWER;
+		p->change |= USB_PORT_STAT_C_CONNECTION;
+		_usbsim_hubNotify(hub);
+	}
+
+	dev->parent = NULL;
+	dev->port = 0;
+	_usbsim_powerOff(dev);
+	mutexUnlock(usbsim_common.lock);
+
+	return 0;
+}
+
+
+void usbsim_statsGet(usbsim_stats_t *stats)
+{
+	mutexLock(usbsim_common.lock);
+	*stats = usbsim_common.stats;
+	mutexUnlock(usbsim_common.lock);
+}
+
+
+static void usbsim_scriptThread(void *arg)
+{
+	/* Regression scripts end with expectations, the result is their verdict */
+	if (usbsim_scriptRun(arg) < 0) {
+		USB_LOG("usbsim: Script %s FAILED\n", (const char *)arg);
+	}
+	else {
+		USB_LOG("usbsim: Script %s passed\n", (const char *)arg);
+	}
+
+	endthread();
+}
+
+
+static void usbsim_stop(void)
+{
+	mutexLock(usbsim_common.lock);
+	usbsim_common.quit = 1;
+	condSignal(usbsim_common.cond);
+	mutexUnlock(usbsim_common.lock);
+
+	threadJoin(usbsim_common.tid, 0);
+	usbsim_common.quit = 0;
+}
+
+
+static void usbsim_devFree(usbsim_dev_t *dev)
+{
+	mutexLock(usbsim_common.lock);
+	LIST_REMOVE(&usbsim_common.devs, dev);
+	mutexUnlock(usbsim_common.lock);
+
+	free(dev->ports);
+	free(dev);
+}
+
+
+static void usbsim_cleanup(void)
+{
+	if (usbsim_common.root != NULL) {
+		usbsim_devFree(usbsim_common.root);
+		usbsim_common.root = NULL;
+	}
+
+	resourceDestroy(usbsim_common.cond);
+	resourceDestroy(usbsim_common.lock);
+	hcdsched_destroy(&usbsim_common.sched);
+}
+
+
+/* Pipes are destroyed by now, only port timers may be left */
+static void usbsim_deinit(hcd_t *hcd)
+{
+	usbsim_dev_t *root = usbsim_common.root;
+	usbsim_event_t *ev;
+	int i;
+
+	usbsim_stop();
+
+	mutexLock(usbsim_common.lock);
+	while ((ev = usbsim_common.events) != NULL) {
+		LIST_REMOVE(&usbsim_common.events, ev);
+		free(ev);
+	}
+
+	/* Devices stay created and can be plugged again once the controller is reattached */
+	for (i = 0; i < root->nports; i++) {
+		if (root->ports[i].dev != NULL) {
+			root->ports[i].dev->parent = NULL;
+			root->ports[i].dev->port = 0;
+			_usbsim_powerOff(root->ports[i].dev);
+			root->ports[i].dev = NULL;
+		}
+	}
+	mutexUnlock(usbsim_common.lock);
+
+	usbsim_cleanup();
+	hcd->priv = NULL;
+}
+
+
+static int usbsim_init(hcd_t *hcd)
+{
+	const char *script;
+
+	if (usbsim_common.root != NULL)
+		return -EBUSY;
+
+	/* Small enough limit to exercise transfer splitting in the core */
+	hcd->caps.maxTransfer = USBSIM_MAX_TRANSFER;
+	hcd->caps.flags = HCD_CAP_SG | HCD_CAP_ISO;
+
+	if (hcdsched_init(&usbsim_common.sched, &usbsim_schedOps, NULL, hcd->caps.frames, USBSIM_FRAME_BUDGET, USBSIM_DEPTH) != 0)
+		return -ENOMEM;
+
+	if (mutexCreate(&usbsim_common.lock) != 0) {
+		hcdsched_destroy(&usbsim_common.sched);
+		return -ENOMEM;
+	}
+
+	if (condCreate(&usbsim_common.cond) != 0) {
+		resourceDestroy(usbsim_common.lock);
+		hcdsched_destroy(&usbsim_common.sched);
+		return -ENOMEM;
+	}
+
+	if ((usbsim_common.root = usbsim_hubCreate("root", USBSIM_ROOT_PORTS, usbsim_speed_high)) == NULL) {
+		usbsim_cleanup();
+		return -ENOMEM;
+	}
+
+	if (beginthreadex(usbsim_worker, USBSIM_PRIO, usbsim_common.stack, sizeof(usbsim_common.stack), hcd, &usbsim_common.tid) != 0) {
+		usbsim_cleanup();
+		return -ENOMEM;
+	}
+
+	/* Topology is built and changed by the script while the stack runs, it outlives a detach */
+	if (!usbsim_common.scripted && (script = getenv("USBSIM_SCRIPT")) != NULL) {
+		if (beginthread(usbsim_scriptThread, USBSIM_PRIO, usbsim_common.scriptStack, sizeof(usbsim_common.scriptStack), (void *)script) != 0) {
+			USB_LOG("usbsim: Fail to start script thread\n");
+			usbsim_stop();
+			usbsim_cleanup();
+			return -ENOMEM;
+		}
+		usbsim_common.scripted = 1;
+	}
+
+	hcd->priv = &usbsim_common;
+
+	return 0;
+}
+
+
+static const hcd_ops_t usbsim_ops = {
+	.type = "sim",
+	.init = usbsim_init,
+	.deinit = usbsim_deinit,
+	.transferEnqueue = usbsim_transferEnqueue,
+	.transferEnqueueBatch = usbsim_transferEnqueueBatch,
+	.transferDequeue = usbsim_transferDequeue,
+	.pipeDestroy = usbsim_pipeDestroy,
+	.getRoothubStatus = usbsim_getRoothubStatus,
+};
+
+
+__attribute__((constructor)) static void usbsim_register(void)
+{
+	hcd_register(&usbsim_ops);
+}
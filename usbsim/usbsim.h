@@ -0,0 +1,81 @@
+/*
+ * Phoenix-RTOS
+ *
+ * Simulated USB host controller
+ *
+ * Copyright 2026 Phoenix Systems
+ *
+ * This file is part of Phoenix-RTOS.
+ *
+ * %LICENSE%
+ */
+
+#ifndef _USBSIM_H_
+#define _USBSIM_H_
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <usb.h>
+
+#define USBSIM_NAME_LEN   16
+#define USBSIM_MAX_EPS    8
+#define USBSIM_ROOT_PORTS 8
+
+/* Same order as enum usb_speed of the host stack */
+enum { usbsim_speed_full = 0, usbsim_speed_low, usbsim_speed_high };
+
+
+typedef struct usbsim_dev usbsim_dev_t;
+
+
+typedef struct {
+	unsigned long long transfers;
+	unsigned long long bytes;
+	unsigned long long errors;
+
+	/* Transfer scheduler */
+	unsigned long long scans;
+	time_t latency; /* Sum of submission to completion times, us */
+	time_t latencyMax;
+} usbsim_stats_t;
+
+
+/* Creates an unattached device with a single interface of desc->bDeviceClass class */
+usbsim_dev_t *usbsim_devCreate(const char *name, const usb_device_desc_t *desc, int speed);
+
+
+usbsim_dev_t *usbsim_hubCreate(const char *name, int nports, int speed);
+
+
+int usbsim_devEndpoint(usbsim_dev_t *dev, uint8_t addr, int type, uint16_t mps, uint8_t interval);
+
+
+/* Latency is added to every transfer, bandwidth in bytes per second (0 - unlimited) */
+void usbsim_devTiming(usbsim_dev_t *dev, time_t latency, unsigned int bandwidth);
+
+
+/* Root hub is available as "root" */
+usbsim_dev_t *usbsim_devFind(const char *name);
+
+
+/* Address and configuration assigned by the host, 0 in the default state */
+void usbsim_devStatus(usbsim_dev_t *dev, int *address, int *configuration);
+
+
+/* Plugs dev into a port of hub, NULL hub is the root hub */
+int usbsim_plug(usbsim_dev_t *hub, int port, usbsim_dev_t *dev);
+
+
+int usbsim_unplug(usbsim_dev_t *dev);
+
+
+void usbsim_statsGet(usbsim_stats_t *stats);
+
+
+int usbsim_scriptLine(char *line);
+
+
+int usbsim_scriptRun(const char *path);
+
+
+#endif